@@ -0,0 +1,1141 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+/*
+ * pskiplist_bench: YCSB-like workloads A-F and microbenchmarks of the
+ * persistent skiplist. Every run gets a fresh pool file, so any file system
+ * works, tmpfs included; only the latencies then differ from Optane.
+ *
+ *   pskiplist_bench --bench=ycsb,insert --lists=default,hybrid --threads=1,2,4,8
+ *
+ * pmem bytes written per op are counted on the libpmemobj calls made by the
+ * list (see PSKIPLIST_BENCH_COUNT_WRITES): flushed ranges, snapshotted
+ * ranges twice (undo log and data) and allocated objects. The allocator
+ * metadata and log headers libpmemobj writes on its own are not included.
+ */
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "persistent_sharded_skiplist.h"
+#include "persistent_skiplist.h"
+#include "persistent_two_level_skiplist.h"
+
+using namespace pmem::kv;
+using pmem::obj::make_persistent;
+using pmem::obj::persistent_ptr;
+using pmem::obj::pool;
+using pmem::obj::transaction;
+
+namespace
+{
+
+/* pmem bytes written, one padded counter per thread index, summed on demand */
+struct alignas(64) write_slot {
+	std::atomic<uint64_t> bytes{0};
+};
+std::array<write_slot, fourpd::kMaxThreads> write_slots;
+
+void count_written(size_t bytes) {
+	std::atomic<uint64_t> &slot = write_slots[fourpd::thread_index()].bytes;
+	slot.store(slot.load(std::memory_order_relaxed) + bytes, std::memory_order_relaxed);
+}
+
+uint64_t pmem_written() {
+	uint64_t total = 0;
+	for (auto &s : write_slots)
+		total += s.bytes.load(std::memory_order_relaxed);
+	return total;
+}
+
+} /* namespace */
+
+#ifdef PSKIPLIST_BENCH_COUNT_WRITES
+/* linked with --wrap=<function> for each of these, see bench/CMakeLists.txt */
+extern "C" {
+void __real_pmemobj_persist(PMEMobjpool *pop, const void *addr, size_t len);
+void __real_pmemobj_flush(PMEMobjpool *pop, const void *addr, size_t len);
+void *__real_pmemobj_memcpy_persist(PMEMobjpool *pop, void *dest, const void *src, size_t len);
+void *__real_pmemobj_memset_persist(PMEMobjpool *pop, void *dest, int c, size_t len);
+int __real_pmemobj_tx_add_range(PMEMoid oid, uint64_t off, size_t size);
+int __real_pmemobj_tx_add_range_direct(const void *ptr, size_t size);
+int __real_pmemobj_tx_xadd_range_direct(const void *ptr, size_t size, uint64_t flags);
+PMEMoid __real_pmemobj_tx_alloc(size_t size, uint64_t type_num);
+PMEMoid __real_pmemobj_tx_zalloc(size_t size, uint64_t type_num);
+PMEMoid __real_pmemobj_tx_xalloc(size_t size, uint64_t type_num, uint64_t flags);
+int __real_pmemobj_xalloc(PMEMobjpool *pop, PMEMoid *oidp, size_t size, uint64_t type_num, uint64_t flags,
+			  pmemobj_constr constructor, void *arg);
+
+void __wrap_pmemobj_persist(PMEMobjpool *pop, const void *addr, size_t len) {
+	count_written(len);
+	__real_pmemobj_persist(pop, addr, len);
+}
+void __wrap_pmemobj_flush(PMEMobjpool *pop, const void *addr, size_t len) {
+	count_written(len);
+	__real_pmemobj_flush(pop, addr, len);
+}
+void *__wrap_pmemobj_memcpy_persist(PMEMobjpool *pop, void *dest, const void *src, size_t len) {
+	count_written(len);
+	return __real_pmemobj_memcpy_persist(pop, dest, src, len);
+}
+void *__wrap_pmemobj_memset_persist(PMEMobjpool *pop, void *dest, int c, size_t len) {
+	count_written(len);
+	return __real_pmemobj_memset_persist(pop, dest, c, len);
+}
+int __wrap_pmemobj_tx_add_range(PMEMoid oid, uint64_t off, size_t size) {
+	count_written(2 * size);
+	return __real_pmemobj_tx_add_range(oid, off, size);
+}
+int __wrap_pmemobj_tx_add_range_direct(const void *ptr, size_t size) {
+	count_written(2 * size);
+	return __real_pmemobj_tx_add_range_direct(ptr, size);
+}
+int __wrap_pmemobj_tx_xadd_range_direct(const void *ptr, size_t size, uint64_t flags) {
+	/* the undo log unless NO_SNAPSHOT, the range unless NO_FLUSH */
+	count_written(((flags & POBJ_XADD_NO_SNAPSHOT) ? 0 : size) + ((flags & POBJ_XADD_NO_FLUSH) ? 0 : size));
+	return __real_pmemobj_tx_xadd_range_direct(ptr, size, flags);
+}
+PMEMoid __wrap_pmemobj_tx_alloc(size_t size, uint64_t type_num) {
+	count_written(size);
+	return __real_pmemobj_tx_alloc(size, type_num);
+}
+PMEMoid __wrap_pmemobj_tx_zalloc(size_t size, uint64_t type_num) {
+	count_written(size);
+	return __real_pmemobj_tx_zalloc(size, type_num);
+}
+PMEMoid __wrap_pmemobj_tx_xalloc(size_t size, uint64_t type_num, uint64_t flags) {
+	count_written((flags & POBJ_XALLOC_NO_FLUSH) ? 0 : size);
+	return __real_pmemobj_tx_xalloc(size, type_num, flags);
+}
+int __wrap_pmemobj_xalloc(PMEMobjpool *pop, PMEMoid *oidp, size_t size, uint64_t type_num, uint64_t flags,
+			  pmemobj_constr constructor, void *arg) {
+	count_written(size);
+	return __real_pmemobj_xalloc(pop, oidp, size, type_num, flags, constructor, arg);
+}
+} /* extern "C" */
+static constexpr bool kCountWrites = true;
+#else
+static constexpr bool kCountWrites = false;
+#endif
+
+namespace
+{
+
+using bench_clock = std::chrono::steady_clock;
+
+/* ---------------------------------------------------------------- options */
+
+struct options {
+	std::string pool = "/dev/shm/pskiplist_bench";
+	size_t pool_mb = 4096;
+	uint64_t records = 1000000;
+	uint64_t ops = 1000000;
+	std::vector<unsigned> threads = {1, 2, 4, 8};
+	std::vector<std::string> benches = {"ycsb"};
+	std::vector<std::string> lists = {"default"};
+	std::vector<std::string> workloads = {"A", "B", "C", "D", "E", "F"};
+	std::vector<std::string> dists = {"uniform", "zipfian"};
+	double theta = 0.99;
+	unsigned shards = 4;
+	std::vector<int> numa;
+	bool csv = false;
+};
+
+std::vector<std::string> split(const std::string &s) {
+	std::vector<std::string> parts;
+	std::stringstream in(s);
+	std::string part;
+	while (std::getline(in, part, ','))
+		if (!part.empty())
+			parts.push_back(part);
+	return parts;
+}
+
+template <typename T>
+std::vector<T> split_numbers(const std::string &s) {
+	std::vector<T> numbers;
+	for (auto &part : split(s))
+		numbers.push_back(static_cast<T>(std::stoll(part)));
+	return numbers;
+}
+
+bool selected(const std::vector<std::string> &names, const std::string &name) {
+	return std::find(names.begin(), names.end(), "all") != names.end() ||
+		std::find(names.begin(), names.end(), name) != names.end();
+}
+
+const char kUsage[] =
+	"usage: pskiplist_bench [--option=value ...]\n"
+	"  --pool=PATH        pool file prefix (default /dev/shm/pskiplist_bench)\n"
+	"  --pool_mb=N        size of each pool file in MiB (default 4096)\n"
+	"  --records=N        records loaded before a run (default 1000000)\n"
+	"  --ops=N            operations per run, over all threads (default 1000000)\n"
+	"  --threads=LIST     thread counts to scale over (default 1,2,4,8)\n"
+	"  --bench=LIST       ycsb insert batch bulk_load lookup scan read_with_writer\n"
+	"                     recover expire mvcc two_level upsert sharded stats, or all\n"
+	"                     (default ycsb)\n"
+	"  --lists=LIST       default inline prefix hybrid slab hash ool versioned\n"
+	"                     strict volatile, or all\n"
+	"  --workloads=LIST   YCSB workloads out of A-F (default all)\n"
+	"  --dist=LIST        uniform zipfian (default both)\n"
+	"  --theta=X          Zipfian constant (default 0.99)\n"
+	"  --shards=N         shards of the sharded benchmark (default 4)\n"
+	"  --numa=LIST        NUMA node of each shard of the sharded benchmark\n"
+	"  --format=table|csv\n";
+
+options parse(int argc, char *argv[]) {
+	options opt;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+			std::fputs(kUsage, stderr);
+			std::exit(arg == "--help" ? 0 : 1);
+		}
+		std::string key = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+		if (key == "pool")
+			opt.pool = value;
+		else if (key == "pool_mb")
+			opt.pool_mb = std::stoull(value);
+		else if (key == "records")
+			opt.records = std::stoull(value);
+		else if (key == "ops")
+			opt.ops = std::stoull(value);
+		else if (key == "threads")
+			opt.threads = split_numbers<unsigned>(value);
+		else if (key == "bench")
+			opt.benches = split(value);
+		else if (key == "lists")
+			opt.lists = split(value);
+		else if (key == "workloads")
+			opt.workloads = split(value);
+		else if (key == "dist")
+			opt.dists = split(value);
+		else if (key == "theta")
+			opt.theta = std::stod(value);
+		else if (key == "shards")
+			opt.shards = std::stoul(value);
+		else if (key == "numa")
+			opt.numa = split_numbers<int>(value);
+		else if (key == "format")
+			opt.csv = value == "csv";
+		else {
+			std::fprintf(stderr, "unknown option --%s\n%s", key.c_str(), kUsage);
+			std::exit(1);
+		}
+	}
+	return opt;
+}
+
+/* -------------------------------------------------------- keys and values */
+
+/* 8-byte big-endian key: byte order is numeric order, so the string key
+ * prefix and hash options apply */
+struct bench_key {
+	unsigned char bytes[8];
+
+	bench_key() = default;
+	explicit bench_key(uint64_t v) {
+		for (int i = 0; i < 8; i++)
+			bytes[i] = static_cast<unsigned char>(v >> (56 - 8 * i));
+	}
+	const char *data() const {
+		return reinterpret_cast<const char *>(bytes);
+	}
+	size_t size() const {
+		return sizeof(bytes);
+	}
+	bool operator<(const bench_key &other) const {
+		return std::memcmp(bytes, other.bytes, sizeof(bytes)) < 0;
+	}
+	bool operator==(const bench_key &other) const {
+		return std::memcmp(bytes, other.bytes, sizeof(bytes)) == 0;
+	}
+};
+
+/* a YCSB record of 16 8-byte fields */
+struct bench_value {
+	uint64_t fields[16];
+
+	bench_value() = default;
+	explicit bench_value(uint64_t seed) {
+		for (auto &f : fields)
+			f = seed++;
+	}
+};
+
+const bench_key kMaxKey(~uint64_t(0));
+
+/* record id to key: a bijective mix, so ids inserted in order land all over
+ * the key space */
+bench_key key_of(uint64_t id) {
+	id += 0x9e3779b97f4a7c15ULL;
+	id = (id ^ (id >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	id = (id ^ (id >> 27)) * 0x94d049bb133111ebULL;
+	return bench_key(id ^ (id >> 31));
+}
+
+/* Zipfian ranks over [0, n), rank 0 the most popular (Gray et al.,
+ * "Quickly generating billion-record synthetic databases") */
+class zipfian {
+public:
+	zipfian(uint64_t n, double theta) : _n(n), _theta(theta) {
+		double zeta2 = zeta(2, theta);
+		_zetan = zeta(n, theta);
+		_alpha = 1.0 / (1.0 - theta);
+		_eta = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / _zetan);
+		_half_pow = 1.0 + std::pow(0.5, theta);
+	}
+
+	/* @u uniform in [0, 1) */
+	uint64_t operator()(double u) const {
+		double uz = u * _zetan;
+		if (uz < 1.0)
+			return 0;
+		if (uz < _half_pow)
+			return 1;
+		return std::min<uint64_t>(_n - 1, static_cast<uint64_t>(_n * std::pow(_eta * u - _eta + 1, _alpha)));
+	}
+
+private:
+	uint64_t _n;
+	double _theta, _zetan, _alpha, _eta, _half_pow;
+
+	static double zeta(uint64_t n, double theta) {
+		double sum = 0;
+		for (uint64_t i = 1; i <= n; i++)
+			sum += 1.0 / std::pow(static_cast<double>(i), theta);
+		return sum;
+	}
+};
+
+/* per-thread choice of existing records */
+class key_chooser {
+public:
+	key_chooser(const zipfian *zipf, unsigned seed) : _zipf(zipf), _rng(seed) {}
+
+	double uniform() {
+		return std::uniform_real_distribution<double>(0.0, 1.0)(_rng);
+	}
+
+	/* an id below @count; @latest favours the newest ones */
+	uint64_t next(uint64_t count, bool latest = false) {
+		uint64_t rank = _zipf ? (*_zipf)(uniform()) : static_cast<uint64_t>(uniform() * count);
+		rank %= count;
+		return latest ? count - 1 - rank : rank;
+	}
+
+	std::mt19937_64 &rng() {
+		return _rng;
+	}
+
+private:
+	const zipfian *_zipf;
+	std::mt19937_64 _rng;
+};
+
+/* ----------------------------------------------------------- list layouts */
+
+constexpr std::size_t kHeight = 16;
+
+struct inline_traits : default_skiplist_traits {
+	static constexpr bool inline_tower = true;
+};
+struct prefix_traits : inline_traits {
+	using key_prefix = string_key_prefix;
+};
+struct hybrid_traits : prefix_traits {
+	static constexpr bool hybrid_index = true;
+};
+struct slab_traits : prefix_traits {
+	static constexpr bool slab_allocator = true;
+};
+struct hash_traits : prefix_traits {
+	using key_hash = string_key_hash;
+};
+struct ool_traits : default_skiplist_traits {
+	using value_placement = out_of_line_values<64>;
+};
+struct versioned_traits : default_skiplist_traits {
+	static constexpr bool versioned = true;
+};
+struct strict_traits : inline_traits {
+	using persist = strict_persist;
+};
+struct volatile_traits : inline_traits {
+	using persist = volatile_persist;
+};
+
+template <typename Traits, typename Value = bench_value>
+using bench_list = persistent_skiplist<bench_key, Value, std::less<bench_key>, kHeight, 4, Traits>;
+
+template <typename T>
+struct tag {
+	using type = T;
+};
+
+/* @f(name, tag<Traits>) for every selected layout */
+template <typename F>
+void for_each_layout(const options &opt, F &&f) {
+	if (selected(opt.lists, "default"))
+		f("default", tag<default_skiplist_traits>());
+	if (selected(opt.lists, "inline"))
+		f("inline", tag<inline_traits>());
+	if (selected(opt.lists, "prefix"))
+		f("prefix", tag<prefix_traits>());
+	if (selected(opt.lists, "hybrid"))
+		f("hybrid", tag<hybrid_traits>());
+	if (selected(opt.lists, "slab"))
+		f("slab", tag<slab_traits>());
+	if (selected(opt.lists, "hash"))
+		f("hash", tag<hash_traits>());
+	if (selected(opt.lists, "ool"))
+		f("ool", tag<ool_traits>());
+	if (selected(opt.lists, "versioned"))
+		f("versioned", tag<versioned_traits>());
+	if (selected(opt.lists, "strict"))
+		f("strict", tag<strict_traits>());
+	if (selected(opt.lists, "volatile"))
+		f("volatile", tag<volatile_traits>());
+}
+
+/* ------------------------------------------------------------------ pools */
+
+template <typename T>
+struct bench_root {
+	persistent_ptr<T> object;
+};
+
+/* a pool file holding one T, removed again when the run is over */
+template <typename T>
+class bench_pool {
+public:
+	bench_pool(const options &opt, unsigned index = 0) : _path(opt.pool + "." + std::to_string(index)) {
+		::unlink(_path.c_str());
+		_pool = pool<bench_root<T>>::create(_path, "pskiplist_bench", opt.pool_mb << 20, S_IWUSR | S_IRUSR);
+		auto root = _pool.root();
+		transaction::run(_pool, [&] { root->object = make_persistent<T>(); });
+		_object = root->object.get();
+	}
+
+	~bench_pool() {
+		_object->runtime_finalize();
+		_pool.close();
+		::unlink(_path.c_str());
+	}
+
+	bench_pool(const bench_pool &) = delete;
+	bench_pool &operator=(const bench_pool &) = delete;
+
+	T &operator*() {
+		return *_object;
+	}
+	T *operator->() {
+		return _object;
+	}
+
+private:
+	std::string _path;
+	pool<bench_root<T>> _pool;
+	T *_object;
+};
+
+/* loads records 0 .. @records - 1 in one bulk_load() */
+template <typename List>
+void load(List &list, uint64_t records) {
+	std::vector<std::pair<bench_key, bench_value>> items;
+	items.reserve(records);
+	for (uint64_t id = 0; id < records; id++)
+		items.emplace_back(key_of(id), bench_value(id));
+	std::sort(items.begin(), items.end(),
+		  [](const std::pair<bench_key, bench_value> &a, const std::pair<bench_key, bench_value> &b) {
+			  return a.first < b.first;
+		  });
+	list.bulk_load(items.begin(), items.end());
+}
+
+/* ---------------------------------------------------------------- results */
+
+struct thread_result {
+	std::vector<uint32_t> latencies;
+	uint64_t ops = 0;
+	uint64_t sink = 0;
+};
+
+struct result {
+	std::string name;
+	unsigned threads;
+	uint64_t ops;
+	double seconds;
+	uint64_t pmem;
+	std::vector<uint32_t> latencies;
+};
+
+std::atomic<uint64_t> sink;
+
+/* times @op into @r */
+template <typename F>
+void timed(thread_result &r, F &&op) {
+	auto start = bench_clock::now();
+	op();
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(bench_clock::now() - start).count();
+	r.latencies.push_back(static_cast<uint32_t>(std::min<uint64_t>(ns, UINT32_MAX)));
+	r.ops++;
+}
+
+/* Runs @body(t, result) on @threads threads that start together and
+ * returns the combined result; the clock stops when the last one ends. */
+template <typename F>
+result run_threads(const std::string &name, unsigned threads, F &&body) {
+	std::vector<thread_result> results(threads);
+	std::atomic<unsigned> ready(0);
+	std::atomic<bool> go(false);
+	std::vector<std::thread> workers;
+	for (unsigned t = 0; t < threads; t++) {
+		workers.emplace_back([&, t] {
+			ready++;
+			while (!go.load(std::memory_order_acquire))
+				std::this_thread::yield();
+			body(t, results[t]);
+		});
+	}
+	while (ready.load() < threads)
+		std::this_thread::yield();
+	uint64_t pmem = pmem_written();
+	auto start = bench_clock::now();
+	go.store(true, std::memory_order_release);
+	for (auto &w : workers)
+		w.join();
+	result res{name, threads, 0, std::chrono::duration<double>(bench_clock::now() - start).count(),
+		   pmem_written() - pmem, {}};
+	for (auto &r : results) {
+		res.ops += r.ops;
+		res.latencies.insert(res.latencies.end(), r.latencies.begin(), r.latencies.end());
+		sink += r.sink;
+	}
+	return res;
+}
+
+/* one call of @f that does @ops operations, reported without latencies */
+template <typename F>
+result run_once(const std::string &name, unsigned threads, F &&f) {
+	uint64_t pmem = pmem_written();
+	auto start = bench_clock::now();
+	uint64_t ops = f();
+	return result{name, threads, ops, std::chrono::duration<double>(bench_clock::now() - start).count(),
+		      pmem_written() - pmem, {}};
+}
+
+class reporter {
+public:
+	explicit reporter(bool csv) : _csv(csv) {}
+
+	void report(result &r) {
+		if (_table != results_table) {
+			_table = results_table;
+			header();
+		}
+		double rate = r.seconds > 0 ? r.ops / r.seconds : 0;
+		double bytes = r.ops ? double(r.pmem) / r.ops : 0;
+		std::array<std::string, 3> pct = {"-", "-", "-"};
+		if (!r.latencies.empty()) {
+			const double q[] = {0.50, 0.99, 0.999};
+			for (int i = 0; i < 3; i++) {
+				auto nth = r.latencies.begin() + static_cast<size_t>(q[i] * (r.latencies.size() - 1));
+				std::nth_element(r.latencies.begin(), nth, r.latencies.end());
+				pct[i] = std::to_string(*nth);
+			}
+		}
+		std::string written = kCountWrites ? format("%.1f", bytes) : "-";
+		if (_csv)
+			std::printf("%s,%u,%llu,%.6f,%.0f,%s,%s,%s,%s\n", r.name.c_str(), r.threads,
+				    (unsigned long long)r.ops, r.seconds, rate, pct[0].c_str(), pct[1].c_str(),
+				    pct[2].c_str(), written.c_str());
+		else
+			std::printf("%-44s %7u %12.0f %9s %9s %9s %10s\n", r.name.c_str(), r.threads, rate,
+				    pct[0].c_str(), pct[1].c_str(), pct[2].c_str(), written.c_str());
+		std::fflush(stdout);
+	}
+
+	/* the hot-path counters of @ops operations, per operation */
+	void counters(const std::string &name, uint64_t ops, const stats_snapshot &d) {
+		if (_table != counters_table) {
+			_table = counters_table;
+			if (_csv)
+				std::printf("counters,name,ops,searches,levels,comparisons,key_reads,pmem_lines,"
+					    "cas_retries,persists,dirty_helps,tx_aborts\n");
+			else
+				std::printf("%s\n%-44s %6s %6s %7s %6s %6s %6s %7s %6s %6s\n%s\n", rule(), "Counters per op",
+					    "search", "levels", "compare", "key rd", "lines", "CAS", "persist", "help",
+					    "abort", rule());
+		}
+		const uint64_t counts[] = {d.searches, d.levels, d.comparisons, d.key_reads, d.pmem_lines,
+					   d.cas_retries, d.persists, d.dirty_helps, d.tx_aborts};
+		const int widths[] = {6, 6, 7, 6, 6, 6, 7, 6, 6};
+		if (_csv)
+			std::printf("counters,%s,%llu", name.c_str(), (unsigned long long)ops);
+		else
+			std::printf("%-44s", name.c_str());
+		for (size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+			double per_op = ops ? double(counts[i]) / ops : 0.0;
+			if (_csv)
+				std::printf(",%.3f", per_op);
+			else
+				std::printf(" %*.2f", widths[i], per_op);
+		}
+		std::printf("\n");
+		std::fflush(stdout);
+	}
+
+private:
+	/* the table printed last; its header is repeated after the other one */
+	enum table { no_table, results_table, counters_table };
+
+	bool _csv;
+	table _table = no_table;
+
+	void header() {
+		if (_csv) {
+			std::printf("name,threads,ops,seconds,ops_per_s,p50_ns,p99_ns,p999_ns,pmem_bytes_per_op\n");
+			return;
+		}
+		std::printf("%s\n%-44s %7s %12s %9s %9s %9s %10s\n%s\n", rule(), "Benchmark", "Threads", "ops/s",
+			    "p50 ns", "p99 ns", "p999 ns", "pmem B/op", rule());
+	}
+
+	static const char *rule() {
+		return "----------------------------------------------------------------------"
+		       "----------------------------------";
+	}
+
+	static std::string format(const char *fmt, double v) {
+		char buf[32];
+		std::snprintf(buf, sizeof(buf), fmt, v);
+		return buf;
+	}
+};
+
+/* ------------------------------------------------------------------- YCSB */
+
+struct workload {
+	const char *name;
+	/* shares of read, update, insert, scan; the rest is read-modify-write */
+	double read, update, insert, scan;
+	bool latest;
+};
+
+const workload kWorkloads[] = {
+	{"A", 0.50, 0.50, 0.00, 0.00, false}, /* update heavy */
+	{"B", 0.95, 0.05, 0.00, 0.00, false}, /* read mostly */
+	{"C", 1.00, 0.00, 0.00, 0.00, false}, /* read only */
+	{"D", 0.95, 0.00, 0.05, 0.00, true},  /* read latest */
+	{"E", 0.00, 0.00, 0.05, 0.95, false}, /* short ranges */
+	{"F", 0.50, 0.00, 0.00, 0.00, false}, /* read-modify-write */
+};
+
+constexpr uint64_t kMaxScan = 100;
+
+/* YCSB update: in place where the layout replaces a record atomically,
+ * see atomic_update, else by erasing and re-inserting it */
+template <typename List>
+void update_record(List &list, const bench_key &key, const bench_value &value, std::true_type) {
+	list.insert_or_assign(key, value);
+}
+
+template <typename List>
+void update_record(List &list, const bench_key &key, const bench_value &value, std::false_type) {
+	list.erase(key);
+	list.try_emplace(key, value);
+}
+
+bench_value bumped(const bench_value &v) {
+	bench_value n = v;
+	n.fields[0]++;
+	return n;
+}
+
+/* YCSB read-modify-write, the same way */
+template <typename List>
+void modify_record(List &list, const bench_key &key, std::true_type) {
+	list.update(key, bumped);
+}
+
+template <typename List>
+void modify_record(List &list, const bench_key &key, std::false_type) {
+	auto it = list.find(key);
+	if (it != list.end())
+		update_record(list, key, bumped(it->second), std::false_type());
+}
+
+template <typename Traits>
+void ycsb(const options &opt, const std::string &layout, reporter &out) {
+	using list_type = bench_list<Traits>;
+	using value_type = typename list_type::value_type;
+	using in_place = std::integral_constant<bool, list_type::atomic_update>;
+	zipfian zipf(opt.records, opt.theta);
+	for (const workload &w : kWorkloads) {
+		if (!selected(opt.workloads, w.name))
+			continue;
+		for (const std::string &dist : opt.dists) {
+			for (unsigned threads : opt.threads) {
+				bench_pool<list_type> list(opt);
+				load(*list, opt.records);
+				std::atomic<uint64_t> next_id(opt.records);
+				const zipfian *z = dist == "zipfian" ? &zipf : nullptr;
+				std::string name = std::string("ycsb_") + w.name + "/" + dist + "/" + layout;
+				result r = run_threads(name, threads, [&](unsigned t, thread_result &res) {
+					key_chooser keys(z, t + 1);
+					uint64_t ops = opt.ops / threads;
+					res.latencies.reserve(ops);
+					for (uint64_t i = 0; i < ops; i++) {
+						double u = keys.uniform();
+						uint64_t count = next_id.load(std::memory_order_relaxed);
+						if (u < w.read) {
+							bench_key key = key_of(keys.next(count, w.latest));
+							timed(res, [&] {
+								auto it = list->find(key);
+								if (it != list->end())
+									res.sink += static_cast<const bench_value &>(it->second).fields[0];
+							});
+						} else if (u < w.read + w.update) {
+							bench_key key = key_of(keys.next(count));
+							bench_value value(i);
+							timed(res, [&] { update_record(*list, key, value, in_place()); });
+						} else if (u < w.read + w.update + w.insert) {
+							uint64_t id = next_id.fetch_add(1);
+							timed(res, [&] { list->try_emplace(key_of(id), bench_value(id)); });
+						} else if (u < w.read + w.update + w.insert + w.scan) {
+							bench_key key = key_of(keys.next(count));
+							uint64_t len = 1 + keys.rng()() % kMaxScan;
+							timed(res, [&] {
+								list->scan(key, kMaxKey, 0, len, [&](const value_type &e) {
+									res.sink += static_cast<const bench_value &>(e.second).fields[0];
+									return true;
+								});
+							});
+						} else {
+							bench_key key = key_of(keys.next(count));
+							timed(res, [&] { modify_record(*list, key, in_place()); });
+						}
+					}
+				});
+				out.report(r);
+			}
+		}
+	}
+}
+
+/* ------------------------------------------------------- microbenchmarks */
+
+/* concurrent inserts of fresh keys into an empty list */
+template <typename Traits>
+void bench_insert(const options &opt, const std::string &layout, reporter &out) {
+	for (unsigned threads : opt.threads) {
+		bench_pool<bench_list<Traits>> list(opt);
+		result r = run_threads("insert/" + layout, threads, [&](unsigned t, thread_result &res) {
+			res.latencies.reserve(opt.records / threads + 1);
+			for (uint64_t id = t; id < opt.records; id += threads)
+				timed(res, [&] { list->try_emplace(key_of(id), bench_value(id)); });
+		});
+		out.report(r);
+	}
+}
+
+/* insert_batch() of 1000 unsorted records per call */
+template <typename Traits>
+void bench_batch(const options &opt, const std::string &layout, reporter &out) {
+	constexpr uint64_t kBatch = 1000;
+	for (unsigned threads : opt.threads) {
+		bench_pool<bench_list<Traits>> list(opt);
+		result r = run_threads("insert_batch/" + layout, threads, [&](unsigned t, thread_result &res) {
+			std::vector<std::pair<bench_key, bench_value>> batch;
+			uint64_t id = t;
+			while (id < opt.records) {
+				batch.clear();
+				for (; id < opt.records && batch.size() < kBatch; id += threads)
+					batch.emplace_back(key_of(id), bench_value(id));
+				res.ops += list->insert_batch(batch.begin(), batch.end());
+			}
+		});
+		out.report(r);
+	}
+}
+
+template <typename Traits>
+void bench_bulk_load(const options &opt, const std::string &layout, reporter &out) {
+	bench_pool<bench_list<Traits>> list(opt);
+	std::vector<std::pair<bench_key, bench_value>> items;
+	for (uint64_t id = 0; id < opt.records; id++)
+		items.emplace_back(key_of(id), bench_value(id));
+	std::sort(items.begin(), items.end(),
+		  [](const std::pair<bench_key, bench_value> &a, const std::pair<bench_key, bench_value> &b) {
+			  return a.first < b.first;
+		  });
+	result r = run_once("bulk_load/" + layout, 1, [&] { return list->bulk_load(items.begin(), items.end()); });
+	out.report(r);
+}
+
+/* find() and lower_bound() of uniformly chosen records, the read-only
+ * search paths without any writer */
+template <typename Traits>
+void bench_lookup(const options &opt, const std::string &layout, reporter &out) {
+	bench_pool<bench_list<Traits>> list(opt);
+	load(*list, opt.records);
+	for (unsigned threads : opt.threads) {
+		result r = run_threads("find/" + layout, threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(nullptr, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(res, [&] { res.sink += list->find(key) != list->end(); });
+			}
+		});
+		out.report(r);
+		r = run_threads("lower_bound/" + layout, threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(nullptr, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(res, [&] { res.sink += list->lower_bound(key) != list->end(); });
+			}
+		});
+		out.report(r);
+	}
+}
+
+/* full scans with scan() and with iterators, one per thread */
+template <typename Traits>
+void bench_scan(const options &opt, const std::string &layout, reporter &out) {
+	using list_type = bench_list<Traits>;
+	for (unsigned threads : opt.threads) {
+		bench_pool<list_type> list(opt);
+		load(*list, opt.records);
+		result r = run_threads("scan/" + layout, threads, [&](unsigned, thread_result &res) {
+			res.ops += list->scan(bench_key(0), kMaxKey, [&](const typename list_type::value_type &e) {
+				res.sink += e.first.bytes[7];
+				return true;
+			});
+		});
+		out.report(r);
+		r = run_threads("iterate/" + layout, threads, [&](unsigned, thread_result &res) {
+			for (auto it = list->begin(), end = list->end(); it != end; ++it) {
+				res.sink += it->first.bytes[7];
+				res.ops++;
+			}
+		});
+		out.report(r);
+	}
+}
+
+/* @Traits with the hot-path counters on, counted apart from other layouts */
+template <typename Traits>
+struct counted_traits : Traits {
+	using stats = counting_stats<Traits>;
+};
+
+/* The hot-path counters of inserts, finds and erases, on one thread so
+ * that they do not depend on races; see stats_snapshot. */
+template <typename Traits>
+void bench_stats(const options &opt, const std::string &layout, reporter &out) {
+	using list_type = bench_list<counted_traits<Traits>>;
+	bench_pool<list_type> list(opt);
+	key_chooser keys(nullptr, 1);
+	stats_snapshot before = list->stats();
+	for (uint64_t id = 0; id < opt.records; id++)
+		list->try_emplace(key_of(id), bench_value(id));
+	stats_snapshot after = list->stats();
+	out.counters("insert/" + layout, opt.records, after - before);
+	before = after;
+	for (uint64_t i = 0; i < opt.ops; i++)
+		sink += list->find(key_of(keys.next(opt.records))) != list->end();
+	after = list->stats();
+	out.counters("find/" + layout, opt.ops, after - before);
+	before = after;
+	for (uint64_t id = 0; id < opt.records; id += 2)
+		list->erase(key_of(id));
+	after = list->stats();
+	out.counters("erase/" + layout, (opt.records + 1) / 2, after - before);
+}
+
+/* finds on every thread but one, which keeps inserting */
+template <typename Traits>
+void bench_read_with_writer(const options &opt, const std::string &layout, reporter &out) {
+	for (unsigned threads : opt.threads) {
+		bench_pool<bench_list<Traits>> list(opt);
+		load(*list, opt.records);
+		std::atomic<bool> done(false);
+		std::thread writer([&] {
+			for (uint64_t id = opt.records; !done.load(std::memory_order_relaxed); id++)
+				list->try_emplace(key_of(id), bench_value(id));
+		});
+		result r = run_threads("read_with_writer/" + layout, threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(nullptr, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(res, [&] { res.sink += list->find(key) != list->end(); });
+			}
+		});
+		done = true;
+		writer.join();
+		/* the writer's flushes are not the readers' */
+		r.pmem = 0;
+		out.report(r);
+	}
+}
+
+template <typename Traits>
+void bench_recover(const options &opt, const std::string &layout, reporter &out) {
+	for (unsigned threads : opt.threads) {
+		bench_pool<bench_list<Traits>> list(opt);
+		load(*list, opt.records);
+		list->runtime_finalize();
+		result r = run_once("recover/" + layout, threads, [&] { return list->recover(threads).nodes; });
+		out.report(r);
+	}
+}
+
+template <typename Traits>
+void bench_expire(const options &opt, const std::string &layout, reporter &out, std::true_type) {
+	bench_pool<bench_list<Traits>> list(opt);
+	load(*list, opt.records);
+	result r = run_once("expire_half/" + layout, 1, [&] { return list->expire_before(bench_key(~uint64_t(0) / 2)); });
+	out.report(r);
+}
+
+/* snapshots of versioned lists could still see expired elements */
+template <typename Traits>
+void bench_expire(const options &, const std::string &, reporter &, std::false_type) {
+}
+
+/* counters of one word, merged in place */
+template <typename Traits>
+void bench_upsert(const options &opt, const std::string &layout, reporter &out) {
+	zipfian zipf(opt.records, opt.theta);
+	for (unsigned threads : opt.threads) {
+		bench_pool<bench_list<Traits, uint64_t>> list(opt);
+		result r = run_threads("upsert_counter/zipfian/" + layout, threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(&zipf, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(res, [&] {
+					list->upsert(key, uint64_t(1), [](uint64_t v, uint64_t d) { return v + d; });
+				});
+			}
+		});
+		out.report(r);
+	}
+}
+
+/* updates on every thread, snapshot scans of 100 records on one more */
+void bench_mvcc(const options &opt, reporter &out) {
+	using list_type = bench_list<versioned_traits>;
+	zipfian zipf(opt.records, opt.theta);
+	for (unsigned threads : opt.threads) {
+		bench_pool<list_type> list(opt);
+		load(*list, opt.records);
+		std::atomic<bool> done(false);
+		thread_result scans;
+		std::thread reader([&] {
+			key_chooser keys(nullptr, 0);
+			while (!done.load(std::memory_order_relaxed)) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(scans, [&] {
+					auto snap = list->snapshot();
+					uint64_t n = 0;
+					list->scan(key, kMaxKey, snap, [&](const list_type::value_type &e) {
+						scans.sink += e.first.bytes[7];
+						return ++n < kMaxScan;
+					});
+				});
+			}
+		});
+		result r = run_threads("mvcc_update/zipfian", threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(&zipf, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				bench_value value(i);
+				timed(res, [&] { list->insert_or_assign(key, value); });
+			}
+		});
+		done = true;
+		reader.join();
+		out.report(r);
+		result s{"mvcc_snapshot_scan100", 1, scans.ops, r.seconds, 0, std::move(scans.latencies)};
+		out.report(s);
+	}
+}
+
+/* records of 10000 primary keys with Zipfian popularity, then the newest 10
+ * records of a key */
+void bench_two_level(const options &opt, reporter &out) {
+	using list_type = persistent_two_level_skiplist<bench_key, uint64_t, bench_value, std::less<bench_key>, kHeight>;
+	constexpr uint64_t kKeys = 10000;
+	zipfian zipf(kKeys, opt.theta);
+	for (unsigned threads : opt.threads) {
+		bench_pool<list_type> list(opt);
+		std::atomic<uint64_t> clock(0);
+		result r = run_threads("two_level_insert/zipfian", threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(&zipf, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key pkey = key_of(keys.next(kKeys));
+				uint64_t ts = clock.fetch_add(1, std::memory_order_relaxed);
+				timed(res, [&] { list->insert(pkey, ts, bench_value(ts)); });
+			}
+		});
+		out.report(r);
+		r = run_threads("two_level_latest10/zipfian", threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(&zipf, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key pkey = key_of(keys.next(kKeys));
+				timed(res, [&] {
+					list->latest(pkey, 10, [&](uint64_t ts, const bench_value &) {
+						res.sink += ts;
+						return true;
+					});
+				});
+			}
+		});
+		out.report(r);
+	}
+}
+
+/* inserts and finds over --shards shards in pools of their own */
+template <typename Traits>
+void bench_sharded(const options &opt, const std::string &layout, reporter &out) {
+	using sharded_type = sharded_skiplist<bench_key, bench_value, hash_partition<string_key_hash>,
+					      std::less<bench_key>, kHeight, 4, Traits>;
+	using list_type = typename sharded_type::list_type;
+	std::string suffix = "/" + layout + "/shards:" + std::to_string(opt.shards);
+	for (unsigned threads : opt.threads) {
+		std::vector<std::unique_ptr<bench_pool<list_type>>> pools;
+		std::vector<list_type *> shards;
+		for (unsigned i = 0; i < opt.shards; i++) {
+			pools.emplace_back(new bench_pool<list_type>(opt, i));
+			shards.push_back(&**pools.back());
+			/* the shard's runtime moves to its node below */
+			shards.back()->runtime_finalize();
+		}
+		std::vector<int> numa = opt.numa;
+		numa.resize(opt.shards, -1);
+		sharded_type list(shards, hash_partition<string_key_hash>(), numa);
+		list.runtime_initialize();
+		result r = run_threads("sharded_insert" + suffix, threads, [&](unsigned t, thread_result &res) {
+			res.latencies.reserve(opt.records / threads + 1);
+			for (uint64_t id = t; id < opt.records; id += threads)
+				timed(res, [&] { list.try_emplace(key_of(id), bench_value(id)); });
+		});
+		out.report(r);
+		r = run_threads("sharded_find/uniform" + suffix, threads, [&](unsigned t, thread_result &res) {
+			key_chooser keys(nullptr, t + 1);
+			uint64_t ops = opt.ops / threads;
+			res.latencies.reserve(ops);
+			for (uint64_t i = 0; i < ops; i++) {
+				bench_key key = key_of(keys.next(opt.records));
+				timed(res, [&] {
+					res.sink += list.find(key) != list.end(list.shard_of(key));
+				});
+			}
+		});
+		out.report(r);
+	}
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[]) {
+	options opt = parse(argc, argv);
+	reporter out(opt.csv);
+	try {
+		if (selected(opt.benches, "bulk_load"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_bulk_load<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "insert"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_insert<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "batch"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_batch<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "ycsb"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				ycsb<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "lookup"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_lookup<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "scan"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_scan<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "read_with_writer"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_read_with_writer<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "recover"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_recover<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "expire"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				using traits = typename decltype(t)::type;
+				bench_expire<traits>(opt, name, out, std::integral_constant<bool, !traits::versioned>());
+			});
+		if (selected(opt.benches, "upsert"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_upsert<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "sharded"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_sharded<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "stats"))
+			for_each_layout(opt, [&](const std::string &name, auto t) {
+				bench_stats<typename decltype(t)::type>(opt, name, out);
+			});
+		if (selected(opt.benches, "mvcc"))
+			bench_mvcc(opt, out);
+		if (selected(opt.benches, "two_level"))
+			bench_two_level(opt, out);
+	} catch (const std::exception &e) {
+		std::fprintf(stderr, "pskiplist_bench: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace fourpd
+{
+
+static const size_t kMaxThreads = 256;
+static const uint64_t kIdleEpoch = std::numeric_limits<uint64_t>::max();
+
+/* Small per-process thread index in [0, kMaxThreads), recycled on thread exit.
+ * A thread beyond kMaxThreads live ones gets std::runtime_error from its
+ * first thread_index() and may try again once another thread has exited. */
+class ThreadIndex {
+private:
+    struct Registry {
+        std::mutex lock;
+        std::vector<size_t> released;
+        size_t next = 0;
+    };
+    static Registry &registry() {
+        static Registry r;
+        return r;
+    }
+    size_t idx;
+public:
+    ThreadIndex() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        if (!r.released.empty()) {
+            idx = r.released.back();
+            r.released.pop_back();
+        } else if (r.next < kMaxThreads) {
+            idx = r.next++;
+        } else {
+            throw std::runtime_error("more than kMaxThreads threads are live");
+        }
+    }
+    ~ThreadIndex() {
+        Registry &r = registry();
+        std::lock_guard<std::mutex> g(r.lock);
+        r.released.push_back(idx);
+    }
+    size_t get() const { return idx; }
+};
+
+inline size_t thread_index() {
+    static thread_local ThreadIndex index;
+    return index.get();
+}
+
+/*
+ * Epoch based reclamation. Threads enter() before touching shared nodes and
+ * exit() afterwards; a retired offset is handed to the reclaim callback only
+ * once every thread that was active when it was retired has left. Callbacks
+ * receive whole batches so that the caller can free them in one transaction.
+ */
+class EpochManager {
+public:
+    using ReclaimFunc = std::function<void(std::vector<uint64_t> &)>;
+
+    class Guard {
+    private:
+        EpochManager *mgr;
+    public:
+        explicit Guard(EpochManager *m): mgr(m) { if (mgr) mgr->enter(); }
+        Guard(const Guard &) = delete;
+        Guard &operator=(const Guard &) = delete;
+        ~Guard() { if (mgr) mgr->exit(); }
+    };
+
+    EpochManager(ReclaimFunc func, size_t batch = 1024):
+        reclaim(std::move(func)), batchSize(batch), globalEpoch(1), retiredCount(0) {
+        for (auto &s : slots)
+            s.epoch.store(kIdleEpoch, std::memory_order_relaxed);
+    }
+
+    ~EpochManager() {
+        drain();
+    }
+
+    void enter() {
+        Slot &s = slots[thread_index()];
+        if (s.depth++ > 0)
+            return;
+        uint64_t e = globalEpoch.load();
+        while (true) {
+            s.epoch.store(e);
+            uint64_t cur = globalEpoch.load();
+            if (cur == e)
+                break;
+            e = cur;
+        }
+    }
+
+    void exit() {
+        Slot &s = slots[thread_index()];
+        assert(s.depth > 0);
+        if (--s.depth == 0)
+            s.epoch.store(kIdleEpoch, std::memory_order_release);
+    }
+
+    /* @offset must already be unreachable for threads entering from now on */
+    void retire(uint64_t offset) {
+        Slot &s = slots[thread_index()];
+        s.retired.emplace_back(globalEpoch.load(), offset);
+        retiredCount.fetch_add(1, std::memory_order_relaxed);
+        if (s.retired.size() >= batchSize)
+            collect(s);
+    }
+
+    /* reclaim whatever the calling thread retired and is now safe to free */
+    size_t collect() {
+        return collect(slots[thread_index()]);
+    }
+
+    /* reclaim everything; only valid once no other thread is active */
+    size_t drain() {
+        size_t freed = 0;
+        std::vector<uint64_t> batch;
+        for (auto &s : slots) {
+            for (auto &r : s.retired)
+                batch.push_back(r.second);
+            s.retired.clear();
+        }
+        if (!batch.empty()) {
+            reclaim(batch);
+            freed = batch.size();
+            retiredCount.fetch_sub(freed, std::memory_order_relaxed);
+        }
+        return freed;
+    }
+
+    /* retired but not yet reclaimed */
+    size_t retired() const {
+        return retiredCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch;
+        uint32_t depth = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> retired;
+    };
+
+    ReclaimFunc reclaim;
+    size_t batchSize;
+    alignas(64) std::atomic<uint64_t> globalEpoch;
+    alignas(64) std::atomic<size_t> retiredCount;
+    Slot slots[kMaxThreads];
+
+    uint64_t minActiveEpoch() {
+        uint64_t min = globalEpoch.load();
+        for (auto &s : slots) {
+            uint64_t e = s.epoch.load();
+            if (e < min)
+                min = e;
+        }
+        return min;
+    }
+
+    size_t collect(Slot &s) {
+        globalEpoch.fetch_add(1);
+        uint64_t safe = minActiveEpoch();
+        std::vector<uint64_t> batch;
+        size_t kept = 0;
+        for (auto &r : s.retired) {
+            if (r.first < safe)
+                batch.push_back(r.second);
+            else
+                s.retired[kept++] = r;
+        }
+        s.retired.resize(kept);
+        if (!batch.empty()) {
+            reclaim(batch);
+            retiredCount.fetch_sub(batch.size(), std::memory_order_relaxed);
+        }
+        return batch.size();
+    }
+};
+
+} /* namespace fourpd */
@@ -0,0 +1,427 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef PERSISTENT_SHARDED_SKIPLIST
+#define PERSISTENT_SHARDED_SKIPLIST
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <exception>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "persistent_skiplist.h"
+
+namespace pmem
+{
+namespace kv
+{
+
+namespace internal
+{
+
+/* keys exposing data() and size(), hashed as byte strings */
+template <typename K, typename = void>
+struct is_byte_string : std::false_type {};
+
+template <typename K>
+struct is_byte_string<K, decltype(void(std::declval<const K &>().data()), void(std::declval<const K &>().size()))>
+	: std::true_type {};
+
+} /* namespace internal */
+
+/* hash_partition's default: string_key_hash for byte-string keys,
+ * std::hash for any other key */
+struct default_key_hash {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		return hash(key, internal::is_byte_string<K>());
+	}
+
+private:
+	template <typename K>
+	static uint64_t hash(const K &key, std::true_type) {
+		return string_key_hash()(key);
+	}
+
+	template <typename K>
+	static uint64_t hash(const K &key, std::false_type) {
+		return std::hash<K>()(key);
+	}
+};
+
+/* partition option: shard by a hash of the key; an ordered scan merges
+ * every shard */
+template <typename Hash = default_key_hash>
+struct hash_partition {
+	Hash hash;
+
+	template <typename K>
+	size_t operator()(const K &key, size_t shards) const {
+		return hash(key) % shards;
+	}
+};
+
+/* partition option: shard i holds the keys from bounds[i - 1] (included) up
+ * to bounds[i], so @bounds has one entry less than there are shards and must
+ * be sorted. @Less must order keys and bounds both ways. */
+template <typename Bound, typename Less = std::less<Bound>>
+struct range_partition {
+	std::vector<Bound> bounds;
+	Less less;
+
+	range_partition() = default;
+	explicit range_partition(std::vector<Bound> b, Less l = Less()) : bounds(std::move(b)), less(l) {}
+
+	template <typename K>
+	size_t operator()(const K &key, size_t shards) const {
+		auto it = std::upper_bound(bounds.begin(), bounds.end(), key,
+			[this](const K &k, const Bound &b) { return less(k, b); });
+		return std::min<size_t>(it - bounds.begin(), shards - 1);
+	}
+};
+
+namespace internal
+{
+
+/* CPUs of NUMA node @node as listed by sysfs; empty if there is no such node */
+inline std::vector<int> numa_node_cpus(int node) {
+	std::vector<int> cpus;
+	std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	std::string range;
+	while (std::getline(in, range, ',')) {
+		int lo, hi;
+		int n = std::sscanf(range.c_str(), "%d-%d", &lo, &hi);
+		if (n < 1)
+			continue;
+		for (int c = lo; c <= (n == 2 ? hi : lo); c++)
+			cpus.push_back(c);
+	}
+	return cpus;
+}
+
+/* ascending merge of one iterator per shard; a binary heap keeps the shard
+ * with the smallest current key in front */
+template <typename List, typename Compare>
+class sharded_skiplist_iterator {
+private:
+	using list_iterator = typename List::iterator;
+
+	struct cursor {
+		list_iterator it, end;
+	};
+
+	std::vector<cursor> _cursors;
+	std::vector<size_t> _heap;
+	Compare _compare;
+
+	/* heap order: the smallest key on top */
+	bool after(size_t a, size_t b) const {
+		return _compare(_cursors[b].it->first, _cursors[a].it->first);
+	}
+
+public:
+	using iterator_category = std::forward_iterator_tag;
+	using difference_type = ptrdiff_t;
+	using value_type = typename std::iterator_traits<list_iterator>::value_type;
+	using reference = typename std::iterator_traits<list_iterator>::reference;
+	using pointer = typename std::iterator_traits<list_iterator>::pointer;
+
+	/* the end of every merge */
+	explicit sharded_skiplist_iterator(Compare compare = Compare()) : _compare(compare) {}
+
+	/* takes a [it, end) pair per shard */
+	sharded_skiplist_iterator(std::vector<std::pair<list_iterator, list_iterator>> ranges, Compare compare)
+		: _compare(compare) {
+		_cursors.reserve(ranges.size());
+		for (auto &r : ranges) {
+			if (r.first != r.second) {
+				_heap.push_back(_cursors.size());
+				_cursors.push_back(cursor{r.first, r.second});
+			}
+		}
+		std::make_heap(_heap.begin(), _heap.end(), [this](size_t a, size_t b) { return after(a, b); });
+	}
+
+	sharded_skiplist_iterator &operator++() {
+		auto order = [this](size_t a, size_t b) { return after(a, b); };
+		std::pop_heap(_heap.begin(), _heap.end(), order);
+		cursor &c = _cursors[_heap.back()];
+		if (++c.it == c.end)
+			_heap.pop_back();
+		else
+			std::push_heap(_heap.begin(), _heap.end(), order);
+		return *this;
+	}
+	sharded_skiplist_iterator operator++(int) {
+		sharded_skiplist_iterator tmp = *this;
+		++*this;
+		return tmp;
+	}
+
+	bool operator==(const sharded_skiplist_iterator &other) const {
+		if (_heap.empty() || other._heap.empty())
+			return _heap.empty() == other._heap.empty();
+		return _cursors[_heap.front()].it == other._cursors[other._heap.front()].it;
+	}
+	bool operator!=(const sharded_skiplist_iterator &other) const {
+		return !(*this == other);
+	}
+
+	reference operator*() const {
+		return *_cursors[_heap.front()].it;
+	}
+	pointer operator->() const {
+		return &**this;
+	}
+};
+
+} /* namespace internal */
+
+/*
+ * N independent persistent_skiplists behind one map interface, so that
+ * writers spread over N heads, N random generators and N pools. A key
+ * belongs to the shard its Partition picks (hash_partition or
+ * range_partition); point operations touch that shard only, ordered
+ * iteration merges all of them.
+ *
+ * The wrapper itself is volatile: the shards are allocated by the caller,
+ * each wherever it should live (one pool per socket keeps the pmem traffic
+ * of a shard local), and after reopening the pools the wrapper is built
+ * again from the same shards in the same order with the same partition.
+ * A shard may be bound to a NUMA node: runtime_initialize() and recover()
+ * then run on that node, so the DRAM runtime of the shard is allocated
+ * there, and bind() moves a worker thread to it.
+ */
+template <typename Key, typename Value, typename Partition = hash_partition<>, typename Compare = std::less<Key>,
+	  std::size_t height = 8, std::size_t branch = 4, typename Traits = default_skiplist_traits>
+class sharded_skiplist {
+public:
+	using list_type = persistent_skiplist<Key, Value, Compare, height, branch, Traits>;
+	using key_type = typename list_type::key_type;
+	using mapped_type = typename list_type::mapped_type;
+	using value_type = typename list_type::value_type;
+	using size_type = std::size_t;
+	using iterator = internal::sharded_skiplist_iterator<list_type, Compare>;
+	/* iterator of one shard, as returned by find() */
+	using local_iterator = typename list_type::iterator;
+	using recovery_stats = typename list_type::recovery_stats;
+
+	/* @numa_nodes, if given, has the node of every shard, -1 for none */
+	explicit sharded_skiplist(std::vector<list_type *> shards, Partition partition = Partition(),
+				  std::vector<int> numa_nodes = std::vector<int>(), Compare compare = Compare())
+		: _shards(std::move(shards)), _partition(std::move(partition)), _compare(compare) {
+		if (_shards.empty())
+			throw std::invalid_argument("a sharded skiplist needs a shard");
+		numa_nodes.resize(_shards.size(), -1);
+		_nodes = std::move(numa_nodes);
+		for (int node : _nodes)
+			_cpus.push_back(node < 0 ? std::vector<int>() : internal::numa_node_cpus(node));
+	}
+
+	sharded_skiplist(const sharded_skiplist &) = delete;
+	sharded_skiplist &operator=(const sharded_skiplist &) = delete;
+
+	/* runtime_initialize() of every shard, in parallel */
+	void runtime_initialize() {
+		for_each_shard([this](size_type i) { _shards[i]->runtime_initialize(); });
+	}
+
+	/* recover() of every shard, in parallel, with @threads each */
+	std::vector<recovery_stats> recover(unsigned threads = 1) {
+		std::vector<recovery_stats> stats(_shards.size());
+		for_each_shard([&](size_type i) { stats[i] = _shards[i]->recover(threads); });
+		return stats;
+	}
+
+	void runtime_finalize() {
+		for (list_type *list : _shards)
+			list->runtime_finalize();
+	}
+
+	size_type shards() const noexcept {
+		return _shards.size();
+	}
+
+	list_type &shard(size_type i) {
+		return *_shards[i];
+	}
+
+	template <typename K>
+	size_type shard_of(const K &key) const {
+		return _partition(key, _shards.size());
+	}
+
+	int numa_node(size_type i) const {
+		return _nodes[i];
+	}
+
+	/* Pins the calling thread to the CPUs of the node of shard @i; false if
+	 * the shard is not bound or pinning failed. */
+	bool bind(size_type i) const {
+		if (_cpus[i].empty())
+			return false;
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int cpu : _cpus[i])
+			CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	}
+
+	template <typename K, typename... Args>
+	std::pair<local_iterator, bool> try_emplace(const K &key, Args &&... args) {
+		return shard_for(key).try_emplace(key, std::forward<Args>(args)...);
+	}
+
+	template <typename K, typename M>
+	std::pair<local_iterator, bool> insert_or_assign(const K &key, M &&obj) {
+		return shard_for(key).insert_or_assign(key, std::forward<M>(obj));
+	}
+
+	template <typename K, typename F>
+	bool update(const K &key, F &&fn) {
+		return shard_for(key).update(key, std::forward<F>(fn));
+	}
+
+	template <typename K, typename M, typename F>
+	std::pair<local_iterator, bool> upsert(const K &key, M &&operand, F &&merge) {
+		return shard_for(key).upsert(key, std::forward<M>(operand), std::forward<F>(merge));
+	}
+
+	/* the element of @key in its shard, or end(shard_of(key)) */
+	template <typename K>
+	local_iterator find(const K &key) {
+		return shard_for(key).find(key);
+	}
+
+	template <typename K>
+	size_type erase(const K &key) {
+		return shard_for(key).erase(key);
+	}
+
+	/* every element in key order */
+	iterator begin() {
+		std::vector<std::pair<local_iterator, local_iterator>> ranges;
+		for (list_type *list : _shards)
+			ranges.emplace_back(list->begin(), list->end());
+		return iterator(std::move(ranges), _compare);
+	}
+	iterator end() {
+		return iterator(_compare);
+	}
+
+	/* the elements of shard @i in key order */
+	local_iterator begin(size_type i) {
+		return _shards[i]->begin();
+	}
+	local_iterator end(size_type i) {
+		return _shards[i]->end();
+	}
+
+	/* the first element not below @key; a range partition skips the
+	 * shards before the one of @key */
+	template <typename K>
+	iterator lower_bound(const K &key) {
+		std::vector<std::pair<local_iterator, local_iterator>> ranges;
+		for (size_type i = first_shard(key); i < _shards.size(); i++)
+			ranges.emplace_back(_shards[i]->lower_bound(key), _shards[i]->end());
+		return iterator(std::move(ranges), _compare);
+	}
+
+	/* Calls @f on the elements in [lo, hi] in key order until @f returns
+	 * false. Returns the number of elements visited. */
+	template <typename K, typename F>
+	size_type scan(const K &lo, const K &hi, F &&f) {
+		size_type visited = 0;
+		for (iterator it = lower_bound(lo), last = end(); it != last && !_compare(hi, it->first); ++it) {
+			visited++;
+			if (!f(*it))
+				break;
+		}
+		return visited;
+	}
+
+	size_type size() const noexcept {
+		size_type n = 0;
+		for (list_type *list : _shards)
+			n += list->size();
+		return n;
+	}
+
+	/* reclaim() of every shard for the calling thread */
+	size_type reclaim() {
+		size_type n = 0;
+		for (list_type *list : _shards)
+			n += list->reclaim();
+		return n;
+	}
+
+private:
+	std::vector<list_type *> _shards;
+	Partition _partition;
+	Compare _compare;
+	std::vector<int> _nodes;
+	std::vector<std::vector<int>> _cpus;
+
+	template <typename K>
+	list_type &shard_for(const K &key) {
+		return *_shards[shard_of(key)];
+	}
+
+	template <typename K>
+	size_type first_shard(const K &key) const {
+		return first_shard(key, std::integral_constant<bool, is_range_partition<Partition>::value>());
+	}
+	template <typename K>
+	size_type first_shard(const K &key, std::true_type) const {
+		return shard_of(key);
+	}
+	template <typename K>
+	size_type first_shard(const K &, std::false_type) const {
+		return 0;
+	}
+
+	template <typename P>
+	struct is_range_partition : std::false_type {};
+	template <typename B, typename L>
+	struct is_range_partition<range_partition<B, L>> : std::true_type {};
+
+	/* @f(i) on one thread per shard, on the node of shard i; the exception
+	 * of the first shard that threw one is rethrown once all are done */
+	template <typename F>
+	void for_each_shard(F &&f) {
+		std::vector<std::thread> workers;
+		std::vector<std::exception_ptr> errors(_shards.size());
+		for (size_type i = 0; i < _shards.size(); i++) {
+			workers.emplace_back([this, &f, &errors, i] {
+				try {
+					bind(i);
+					f(i);
+				} catch (...) {
+					errors[i] = std::current_exception();
+				}
+			});
+		}
+		for (auto &w : workers)
+			w.join();
+		for (auto &e : errors) {
+			if (e)
+				std::rethrow_exception(e);
+		}
+	}
+};
+
+} // namespace kv
+} // namespace pmem
+
+#endif // PERSISTENT_SHARDED_SKIPLIST
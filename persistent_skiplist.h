@@ -13,13 +13,32 @@
 #include <libpmemobj++/pool.hpp>
 #include <libpmemobj++/transaction.hpp>
 
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <array>
 #include <numeric>
 #include <type_traits>
 #include <vector>
 #include <chrono>
 #include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <map>
+#include <new>
+#include <set>
+#include <stdexcept>
 
 #include "smartpptr.h"
+#include "epoch.h"
+#include "volatile_index.h"
+#include "volatile_hash.h"
+#include "slab_allocator.h"
+#include "skiplist_stats.h"
+#include "skiplist_persist.h"
 
 #include <iostream>
 
@@ -27,17 +46,372 @@ namespace pmem
 {
 namespace kv
 {
+
+/* key_prefix option: no prefix is cached */
+struct no_key_prefix {};
+
+/* key_prefix option for byte-string keys exposing data() and size(): the first
+ * 8 bytes, big-endian, zero padded. Only valid when Compare orders keys as
+ * unsigned bytes, lexicographically. */
+struct string_key_prefix {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		const unsigned char *data = reinterpret_cast<const unsigned char *>(key.data());
+		size_t n = std::min<size_t>(key.size(), sizeof(uint64_t));
+		uint64_t prefix = 0;
+		for (size_t i = 0; i < n; i++)
+			prefix |= uint64_t(data[i]) << (56 - 8 * i);
+		return prefix;
+	}
+};
+
+/* key_hash option: no hash index; never called */
+struct no_key_hash {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		return 0;
+	}
+};
+
+/* key_hash option for byte-string keys exposing data() and size(): 64-bit
+ * FNV-1a over the bytes */
+struct string_key_hash {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		const unsigned char *data = reinterpret_cast<const unsigned char *>(key.data());
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < key.size(); i++)
+			hash = (hash ^ data[i]) * 1099511628211ULL;
+		return hash;
+	}
+};
+
+/*
+ * A value in its own allocation, referenced by an offset relative to the
+ * holder, so that the node only carries 8 bytes for it. The offset is
+ * replaced with one atomic store: readers see the old or the new value,
+ * never a mix. Must be created and destroyed inside a transaction.
+ */
+template <typename T>
+class out_of_line {
+public:
+	using value_type = T;
+
+	template <typename V, typename = typename std::enable_if<
+		!std::is_same<typename std::decay<V>::type, out_of_line>::value>::type>
+	explicit out_of_line(V &&value) {
+		_off.store(offset_of(allocate(std::forward<V>(value))), std::memory_order_relaxed);
+	}
+
+	out_of_line(const out_of_line &) = delete;
+	out_of_line &operator=(const out_of_line &) = delete;
+
+	~out_of_line() {
+		destroy(get_ptr());
+	}
+
+	const T &get() const {
+		return *get_ptr();
+	}
+	T &get() {
+		return *get_ptr();
+	}
+	operator const T &() const {
+		return get();
+	}
+	const T *operator->() const {
+		return get_ptr();
+	}
+	T *operator->() {
+		return get_ptr();
+	}
+	/* where the value lives, so that scans can prefetch it */
+	const T *data() const {
+		return get_ptr();
+	}
+
+	/* Publishes a copy of @value, allocated in the running transaction, if
+	 * the current value is still @expected; the copy is freed again
+	 * otherwise. The caller passes the replaced value to destroy() once no
+	 * reader can hold it any more. */
+	template <typename V>
+	bool compare_exchange(const T *expected, V &&value) {
+		assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+		T *fresh = allocate(std::forward<V>(value));
+		pmemobj_tx_add_range_direct(&_off, sizeof(_off));
+		int64_t want = offset_of(expected);
+		if (_off.compare_exchange_strong(want, offset_of(fresh), std::memory_order_acq_rel))
+			return true;
+		destroy(fresh);
+		return false;
+	}
+
+	/* frees a value inside a transaction */
+	static void destroy(T *value) {
+		pmem::obj::delete_persistent<T>(pmem::obj::persistent_ptr<T>(pmemobj_oid(value)));
+	}
+
+private:
+	std::atomic<int64_t> _off;
+
+	template <typename V>
+	static T *allocate(V &&value) {
+		return pmem::obj::make_persistent<T>(std::forward<V>(value)).get();
+	}
+
+	int64_t offset_of(const T *value) const {
+		return reinterpret_cast<const char *>(value) - reinterpret_cast<const char *>(this);
+	}
+
+	T *get_ptr() const {
+		return reinterpret_cast<T *>(const_cast<char *>(reinterpret_cast<const char *>(this)) +
+			_off.load(std::memory_order_acquire));
+	}
+};
+
+/* value_placement option: every value is stored in its node */
+struct inline_values {
+	template <typename T>
+	using stored = T;
+};
+
+/* value_placement option: values larger than @Threshold bytes are stored
+ * behind an out_of_line<T>, smaller ones in the node */
+template <std::size_t Threshold = 64>
+struct out_of_line_values {
+	template <typename T>
+	using stored = typename std::conditional<(sizeof(T) > Threshold), out_of_line<T>, T>::type;
+};
+
+/* Per-list layout options. Derive from this struct and override members to
+ * select a different layout; the defaults keep the original pool layout. */
+struct default_skiplist_traits {
+	/* store the next-pointer tower inside the node allocation */
+	static constexpr bool inline_tower = false;
+	/* order-preserving 64-bit key prefix kept in each node, so that searches
+	 * only read the key itself when prefixes tie */
+	using key_prefix = no_key_prefix;
+	/* keep only level 0 in pmem; the upper levels are a DRAM index rebuilt
+	 * by runtime_initialize(). Best combined with a key_prefix. */
+	static constexpr bool hybrid_index = false;
+	/* keep a span count on every link for O(log n) rank() and operator[];
+	 * writers of the list are serialized. Not combinable with hybrid_index. */
+	static constexpr bool indexable = false;
+	/* erase only stamps a node deleted and keeps it as an old version, so
+	 * that snapshot() readers see the list as of their timestamp. Versions
+	 * are purged once no snapshot can see them. Not combinable with indexable. */
+	static constexpr bool versioned = false;
+	/* carve nodes from per-height slabs owned by the list instead of one
+	 * pmem allocation each; free slots are recomputed on every open.
+	 * Needs inline_tower. */
+	static constexpr bool slab_allocator = false;
+	/* where values are stored, see out_of_line_values. The list's
+	 * mapped_type is the stored type, e.g. out_of_line<T>. */
+	using value_placement = inline_values;
+	/* hash of keys for a DRAM hash index that answers find() with one
+	 * probe, rebuilt by runtime_initialize(). Keys comparing equal must
+	 * hash equal, whatever types find() is called with. */
+	using key_hash = no_key_hash;
+	/* hot-path counters and event trace: no_stats, counting_stats or
+	 * tracing_stats, read back with the list's stats() */
+	using stats = no_stats;
+	/* how the list's own writes are made durable: batched_persist drains
+	 * once per operation, strict_persist after every step, volatile_persist
+	 * never */
+	using persist = batched_persist;
+};
+
 namespace internal
 {
 
 using namespace pmem::obj;
 
-template <typename Key, typename T>
+/* next-pointer tower in its own persistent array */
+template <typename Link>
+class external_tower {
+public:
+	static constexpr size_t extra_size(uint8_t height) {
+		return 0;
+	}
+	void create(uint8_t height) {
+		_nexts = make_persistent<Link[]>(height);
+	}
+	void destroy(uint8_t height) {
+		delete_persistent<Link[]>(_nexts, height);
+	}
+	Link *get(void *node_end) const {
+		return _nexts.get();
+	}
+private:
+	persistent_ptr<Link[]> _nexts;
+};
+
+/* next-pointer tower placed right after the node in the same allocation */
+template <typename Link>
+class inline_tower {
+public:
+	static constexpr size_t extra_size(uint8_t height) {
+		return sizeof(Link) * height;
+	}
+	void create(uint8_t height) {}
+	void destroy(uint8_t height) {}
+	Link *get(void *node_end) const {
+		return reinterpret_cast<Link *>(node_end);
+	}
+};
+
+/* span counts of an indexable node, laid out like its links. They are never
+ * flushed: runtime_initialize() recomputes them from the links. */
+template <typename Tower>
+class span_field {
+public:
+	static constexpr bool enabled = true;
+	static constexpr size_t extra_size(uint8_t height) {
+		return Tower::extra_size(height);
+	}
+	void create(uint8_t height) {
+		_tower.create(height);
+	}
+	void destroy(uint8_t height) {
+		_tower.destroy(height);
+	}
+	uint64_t *get(void *end) const {
+		return _tower.get(end);
+	}
+private:
+	Tower _tower;
+};
+
+template <>
+class span_field<void> {
+public:
+	static constexpr bool enabled = false;
+	static constexpr size_t extra_size(uint8_t height) {
+		return 0;
+	}
+	void create(uint8_t height) {}
+	void destroy(uint8_t height) {}
+	uint64_t *get(void *end) const {
+		return nullptr;
+	}
+};
+
+/* cached key prefix of a node */
+template <typename Prefix>
+class key_prefix_field {
+public:
+	static constexpr bool enabled = true;
+	template <typename K>
+	static uint64_t of(const K &key) {
+		return Prefix()(key);
+	}
+	template <typename K>
+	void assign(const K &key) {
+		_prefix = of(key);
+	}
+	uint64_t get() const {
+		return _prefix.get_ro();
+	}
+private:
+	p<uint64_t> _prefix;
+};
+
+template <>
+class key_prefix_field<no_key_prefix> {
+public:
+	static constexpr bool enabled = false;
+	template <typename K>
+	static uint64_t of(const K &key) {
+		return 0;
+	}
+	template <typename K>
+	void assign(const K &key) {}
+	uint64_t get() const {
+		return 0;
+	}
+};
+
+/* creation and deletion stamps of a versioned node. The creation stamp is
+ * set before the node is linked, runtime_initialize() purges deleted nodes
+ * and restarts the clock; the deletion stamp is claimed by CAS, the node
+ * flushes it. */
+template <bool Enabled>
+class version_field {
+public:
+	static constexpr bool enabled = true;
+	version_field() : _created(0), _deleted(0) {}
+	uint64_t created() const {
+		return _created;
+	}
+	void set_created(uint64_t ts) {
+		_created = ts;
+	}
+	uint64_t deleted() const {
+		return _deleted.load(std::memory_order_acquire);
+	}
+	bool hide(uint64_t ts) {
+		uint64_t expected = 0;
+		return _deleted.compare_exchange_strong(expected, ts);
+	}
+private:
+	uint64_t _created;
+	std::atomic<uint64_t> _deleted;
+};
+
+template <>
+class version_field<false> {
+public:
+	static constexpr bool enabled = false;
+	uint64_t created() const {
+		return 0;
+	}
+	void set_created(uint64_t ts) {}
+	uint64_t deleted() const {
+		return 0;
+	}
+	bool hide(uint64_t ts) {
+		return false;
+	}
+};
+
+template <typename M>
+struct is_out_of_line : std::false_type {};
+
+template <typename T>
+struct is_out_of_line<out_of_line<T>> : std::true_type {};
+
+/* values updated by one atomic store: trivially copyable, naturally aligned
+ * and at most 8 bytes */
+template <typename M>
+struct is_atomic_word : std::integral_constant<bool, std::is_trivially_copyable<M>::value &&
+	sizeof(M) <= sizeof(uint64_t) && sizeof(M) == alignof(M)> {};
+
+template <size_t Size>
+struct atomic_word {};
+template <>
+struct atomic_word<1> { using type = uint8_t; };
+template <>
+struct atomic_word<2> { using type = uint16_t; };
+template <>
+struct atomic_word<4> { using type = uint32_t; };
+template <>
+struct atomic_word<8> { using type = uint64_t; };
+
+/* prefetch the out-of-line storage of keys and values exposing data() */
+template <typename V>
+auto prefetch_data(const V &v, int) -> decltype(v.data(), void()) {
+	__builtin_prefetch(v.data());
+}
+
+template <typename V>
+void prefetch_data(const V &v, long) {}
+
+template <typename Key, typename T, typename Traits>
 class slnode_t {
 public:
-	using self_type = slnode_t<Key, T>;
+	using self_type = slnode_t<Key, T, Traits>;
 	using key_type = Key;
-	using mapped_type = T;
+	using mapped_type = typename Traits::value_placement::template stored<T>;
 	using size_type = std::size_t;
 	using level_type = uint8_t;
 
@@ -52,32 +426,51 @@ public:
 	
 	using slnode_pptr = ::fourpd::SmartPPtr<self_type>;
 	using atomic_slnode_pptr = std::atomic<slnode_pptr>;
+	using tower_type = typename std::conditional<Traits::inline_tower,
+		inline_tower<atomic_slnode_pptr>, external_tower<atomic_slnode_pptr>>::type;
+	using prefix_type = key_prefix_field<typename Traits::key_prefix>;
+	using version_type = version_field<Traits::versioned>;
+	using stats_type = typename Traits::stats;
+	using persist_type = typename Traits::persist;
+	using span_type = span_field<typename std::conditional<Traits::indexable,
+		typename std::conditional<Traits::inline_tower, inline_tower<uint64_t>, external_tower<uint64_t>>::type,
+		void>::type>;
+
+	/* bytes to allocate for a node of @height */
+	static constexpr size_t alloc_size(uint8_t height) {
+		return tower_offset() + tower_type::extra_size(tower_height(height)) +
+			span_type::extra_size(tower_height(height));
+	}
+
+	/* number of persistent links of a node of @height */
+	static constexpr uint8_t tower_height(uint8_t height) {
+		return (Traits::hybrid_index && height > 1) ? 1 : height;
+	}
 
 	template <typename K, typename M>
-	slnode_t(K &&key, M &&obj, uint8_t height): _ref(1) {
+	slnode_t(K &&key, M &&obj, uint8_t height) {
 		assert(pmemobj_tx_stage() == TX_STAGE_WORK);
 		assert(height > 0);
 		try {
 			_height = height;
-			LOG4P_DEBUG("_height = %u", unsigned(height));
-			pointer x = new (&_entry) value_type(std::forward<K>(key), std::forward<M>(obj));
-			assert(x == &_entry);
-			LOG4P_DEBUG("_entry = %p : first = %s,second = %s", (void*)(&_entry), _entry.first.data(), _entry.second.data());
-			_nexts = make_persistent<atomic_slnode_pptr[]>(height);
-			LOG4P_DEBUG("_nexts = %p", _nexts.get());
+			_linker.store(kLinked, std::memory_order_relaxed);
+			new (&_entry) value_type(std::forward<K>(key), std::forward<M>(obj));
+			_prefix.assign(_entry.first);
+			_tower.create(tower_height(height));
+			_spans.create(tower_height(height));
 		} catch (transaction_error &e) {
 			std::terminate();
 		}
 	}
 
-	slnode_t(uint8_t height): _ref(1) { // for head & tail
+	slnode_t(uint8_t height) { // for head & tail
 		assert(pmemobj_tx_stage() == TX_STAGE_WORK);
 		try {
 			_height = height;
-			LOG4P_DEBUG("_height = %u", unsigned(height));
+			_linker.store(kLinked, std::memory_order_relaxed);
 			if (height > 0) {
-				_nexts = make_persistent<atomic_slnode_pptr[]>(height);
-				LOG4P_DEBUG("_nexts = %p", _nexts.get());
+				_tower.create(tower_height(height));
+				_spans.create(tower_height(height));
 			}
 		} catch (transaction_error &e) {
 			LOG4P_ERROR("transaction_error");
@@ -91,7 +484,8 @@ public:
 		try {
 			_entry.first.~key_type();
 			_entry.second.~mapped_type();
-			delete_persistent<atomic_slnode_pptr[]>(_nexts, _height.get_ro());
+			_tower.destroy(levels());
+			_spans.destroy(levels());
 		} catch (transaction_error &e) {
 			std::terminate();
 		}
@@ -101,10 +495,26 @@ public:
 		return _height.get_ro();
 	}
 
+	uint8_t levels() {
+		return tower_height(height());
+	}
+
 	const key_type& getKey() {
         return _entry.first;
     }
 
+	uint64_t key_prefix() const {
+		return _prefix.get();
+	}
+
+	/* where a search reads the link of @lv and the prefix, for the stats */
+	const void *next_addr(level_type lv) {
+		return &nexts()[lv];
+	}
+	const void *prefix_addr() const {
+		return &_prefix;
+	}
+
 	reference getValue() {
 		return _entry;
 	}
@@ -117,46 +527,236 @@ public:
 		return (_height == 0);
 	}
 
-	slnode_ptr get_next_ptr(level_type lv) {
-		return get_next_pptr(lv).getVptr(pmemobj_pool_by_oid(pmemobj_oid(this)));
+	slnode_ptr get_next_ptr(PMEMobjpool *pop, level_type lv) {
+		return get_next_pptr(pop, lv).getVptr(pop);
 	}
-	slnode_pptr get_next_pptr(level_type lv) {
-		auto expected = _nexts[lv].load(std::memory_order_relaxed);
-		auto target = slnode_pptr(expected.getOffset(), false, false);
-		while (true) {
-			if (expected.isDirty()) {
-				if (!(_nexts[lv].compare_exchange_strong(expected, target))) {
-					expected = _nexts[lv].load(std::memory_order_relaxed);
-					target = slnode_pptr(expected.getOffset(), false, false);
-					continue;
-				}
-				pmemobj_persist(pmemobj_pool_by_oid(pmemobj_oid(this)), &(expected), sizeof(expected));
-			}
-			break;
-		}
-		return target;
+	/* Helping load for writers: a link still marked kDirtyFlag is made
+	 * durable and the flag cleared, so CASes can expect clean links. */
+	slnode_pptr get_next_pptr(PMEMobjpool *pop, level_type lv) {
+		slnode_pptr link = load_next_pptr(lv);
+		if (!link.isDirty())
+			return link;
+		slnode_pptr clean(link.getOffset(), link.isDelete(), false);
+		stats_type::add(stat::dirty_helps);
+		stats_type::trace(trace_event::dirty_help, lv);
+		persist_next(pop, lv);
+		cas_next_pptr(lv, link, clean);
+		return clean;
+	}
+
+	/* Pure load for readers: never writes or flushes; flags are kept */
+	slnode_ptr load_next_ptr(PMEMobjpool *pop, level_type lv) {
+		return load_next_pptr(lv).getVptr(pop);
+	}
+	slnode_pptr load_next_pptr(level_type lv) {
+		return nexts()[lv].load(std::memory_order_acquire);
 	}
 
 	void set_next_pptr(level_type lv, const slnode_pptr &node) {
-		assert(lv < _height && lv >= 0);
-		_nexts[lv].store(node, std::memory_order_relaxed);
+		assert(lv < levels() && lv >= 0);
+		nexts()[lv].store(node, std::memory_order_relaxed);
+	}
+
+	bool cas_next_pptr(level_type lv, slnode_pptr expected, const slnode_pptr &desired) {
+		assert(lv < levels());
+		return nexts()[lv].compare_exchange_strong(expected, desired);
+	}
+
+	/* link-and-persist: publish @desired with kDirtyFlag set, flush the link,
+	 * then clear the flag. Readers that observe the dirty link help persist it. */
+	bool link_next_pptr(PMEMobjpool *pop, level_type lv, const slnode_pptr &expected, const slnode_pptr &desired) {
+		if (!publish_next_pptr(pop, lv, expected, desired))
+			return false;
+		persist_type::drain(pop);
+		settle_next_pptr(lv, desired);
+		return true;
+	}
+
+	/* first half of link_next_pptr(): CAS in the dirty link and flush it
+	 * without draining, so that several links can share one drain. Links
+	 * that are never flushed are published clean. */
+	bool publish_next_pptr(PMEMobjpool *pop, level_type lv, const slnode_pptr &expected, const slnode_pptr &desired) {
+		if (!cas_next_pptr(lv, expected, slnode_pptr(desired.getOffset(), desired.isDelete(), persist_type::flushes)))
+			return false;
+		flush_next(pop, lv);
+		return true;
 	}
 
-	void pin() {
-		_ref++;
+	/* second half: clear kDirtyFlag once the link is durable */
+	void settle_next_pptr(level_type lv, const slnode_pptr &desired) {
+		if (persist_type::flushes)
+			cas_next_pptr(lv, slnode_pptr(desired.getOffset(), desired.isDelete(), true), desired);
 	}
 
-	void unpin() {
-		_ref--;
+	/* logically delete the link at @lv; returns false if it was already marked */
+	bool mark_next_pptr(PMEMobjpool *pop, level_type lv) {
+		if (!publish_mark(pop, lv))
+			return false;
+		persist_type::drain(pop);
+		settle_mark(lv);
+		return true;
+	}
+
+	/* mark_next_pptr() up to the drain, see publish_next_pptr() */
+	bool publish_mark(PMEMobjpool *pop, level_type lv) {
+		auto expected = get_next_pptr(pop, lv);
+		while (!expected.isDelete()) {
+			if (publish_next_pptr(pop, lv, expected, slnode_pptr(expected.getOffset(), true, false)))
+				return true;
+			stats_type::add(stat::cas_retries);
+			stats_type::trace(trace_event::cas_retry, lv);
+			expected = get_next_pptr(pop, lv);
+		}
+		return false;
+	}
+
+	/* a marked link never changes again, only its kDirtyFlag is cleared */
+	void settle_mark(level_type lv) {
+		settle_next_pptr(lv, slnode_pptr(load_next_pptr(lv).getOffset(), true, false));
+	}
+
+	void persist_next(PMEMobjpool *pop, level_type lv) {
+		flush_next(pop, lv);
+		persist_type::drain(pop);
+	}
+
+	void flush_next(PMEMobjpool *pop, level_type lv) {
+		flush(pop, &nexts()[lv], sizeof(atomic_slnode_pptr));
+	}
+
+	/* The node and its links before it is published. An inline tower makes
+	 * it one range, allocations left unflushed by their transaction
+	 * included; an external tower was flushed with the node, only the
+	 * links are. */
+	void flush_node(PMEMobjpool *pop) {
+		char *end = reinterpret_cast<char *>(nexts() + levels());
+		if (Traits::inline_tower)
+			flush(pop, this, end - reinterpret_cast<char *>(this));
+		else
+			flush(pop, nexts(), sizeof(atomic_slnode_pptr) * levels());
+	}
+
+	/* a range of the node or of what it owns, e.g. its value */
+	static void flush(PMEMobjpool *pop, const void *addr, size_t len) {
+		if (!persist_type::flushes)
+			return;
+		stats_type::add(stat::persists);
+		persist_type::flush(pop, addr, len);
+	}
+
+	/* the node itself; an inline tower follows it */
+	void prefetch() const {
+		__builtin_prefetch(this);
+		__builtin_prefetch(reinterpret_cast<const char *>(this) + 64);
+	}
+
+	void prefetch_entry() const {
+		prefetch_data(_entry.first, 0);
+		prefetch_data(_entry.second, 0);
+	}
+
+	/* level-0 successor, skipping versions hidden by an erase */
+	slnode_ptr next_visible(PMEMobjpool *pop) {
+		slnode_ptr next = load_next_ptr(pop, 0);
+		while (next->hidden())
+			next = next->load_next_ptr(pop, 0);
+		return next;
+	}
+
+	uint64_t created() const {
+		return _versions.created();
+	}
+
+	void set_created(uint64_t ts) {
+		_versions.set_created(ts);
+	}
+
+	uint64_t deleted() const {
+		return _versions.deleted();
+	}
+
+	/* versioned lists: erased, but possibly still seen by a snapshot */
+	bool hidden() const {
+		return version_type::enabled && _versions.deleted() != 0;
+	}
+
+	/* stamps the node deleted at @ts and flushes the stamp without
+	 * draining; false if it already was */
+	bool hide(PMEMobjpool *pop, uint64_t ts) {
+		if (!_versions.hide(ts))
+			return false;
+		flush(pop, &_versions, sizeof(_versions));
+		return true;
+	}
+
+	/* part of the snapshot taken at @ts */
+	bool visible_at(uint64_t ts) const {
+		uint64_t deleted = _versions.deleted();
+		return _versions.created() <= ts && (deleted == 0 || deleted > ts);
+	}
+
+	/* The inserter owns the node until its tower is linked: it calls
+	 * begin_linking() before the node goes live and end_linking() when
+	 * done. An eraser finishing first calls hand_over() instead of retiring
+	 * the node. A crash can leave kLinking behind, recover() resets it. */
+	void begin_linking() {
+		_linker.store(kLinking, std::memory_order_relaxed);
+	}
+
+	/* false if an eraser handed the node over; it is the caller's to retire */
+	bool end_linking() {
+		uint8_t expected = kLinking;
+		return _linker.compare_exchange_strong(expected, kLinked);
+	}
+
+	/* true if the inserter is still linking and will retire the node */
+	bool hand_over() {
+		uint8_t expected = kLinking;
+		return _linker.compare_exchange_strong(expected, kHandedOver);
+	}
+
+	void reset_linking() {
+		_linker.store(kLinked, std::memory_order_relaxed);
+	}
+
+	/* level-0 distance covered by the link at @lv, indexable lists only */
+	uint64_t span(level_type lv) {
+		return spans()[lv];
+	}
+
+	void set_span(level_type lv, uint64_t span) {
+		assert(lv < levels());
+		spans()[lv] = span;
 	}
 
 private:
+	static constexpr uint8_t kLinked = 0;
+	static constexpr uint8_t kLinking = 1;
+	static constexpr uint8_t kHandedOver = 2;
+
 	union {
 		value_type _entry;
 	};
-	persistent_ptr<atomic_slnode_pptr[]> _nexts;
+	tower_type _tower;
 	p<uint8_t> _height;
-	std::atomic<uint16_t> _ref;
+	/* DRAM only, a byte of what used to be padding, see begin_linking() */
+	std::atomic<uint8_t> _linker;
+	prefix_type _prefix;
+	span_type _spans;
+	version_type _versions;
+
+	static constexpr size_t tower_offset() {
+		return (sizeof(self_type) + alignof(atomic_slnode_pptr) - 1) & ~(alignof(atomic_slnode_pptr) - 1);
+	}
+
+	atomic_slnode_pptr *nexts() {
+		return _tower.get(reinterpret_cast<char *>(this) + tower_offset());
+	}
+
+	uint64_t *spans() {
+		return _spans.get(reinterpret_cast<char *>(this) + tower_offset() +
+			tower_type::extra_size(levels()));
+	}
 };
 
 template <typename NodeType, bool is_const>
@@ -167,6 +767,8 @@ private:
 	friend class persistent_skiplist_iterator<slnode_type, true>;
 
 	slnode_ptr _current_node;
+	PMEMobjpool *_pop;
+	::fourpd::EpochManager *_epoch;
 public:
 	using iterator_category = std::forward_iterator_tag;
 	using difference_type = ptrdiff_t;
@@ -174,25 +776,40 @@ public:
 	using reference = typename slnode_type::reference;
 	using pointer = typename slnode_type::pointer;
 
+	/* an iterator keeps its epoch entered, so the node it points to is not
+	 * reclaimed under it; iterators must not be handed over to other threads.
+	 * Iteration uses pure loads and may observe links that are not durable yet. */
 	persistent_skiplist_iterator(std::nullptr_t)
-		: _current_node(nullptr) {}
-	persistent_skiplist_iterator(slnode_ptr node)
-		: _current_node(node) {}
+		: _current_node(nullptr), _pop(nullptr), _epoch(nullptr) {}
+	persistent_skiplist_iterator(slnode_ptr node, PMEMobjpool *pop, ::fourpd::EpochManager *epoch)
+		: _current_node(node), _pop(pop), _epoch(epoch) { enter(); }
 	persistent_skiplist_iterator(const persistent_skiplist_iterator &other)
-		: _current_node(other._current_node) {}
+		: _current_node(other._current_node), _pop(other._pop), _epoch(other._epoch) { enter(); }
 	template <typename T = void, typename = typename std::enable_if<is_const, T>::type>
 	persistent_skiplist_iterator(const persistent_skiplist_iterator<slnode_type, false> &other)
-		: _current_node(other._current_node) {}
+		: _current_node(other._current_node), _pop(other._pop), _epoch(other._epoch) { enter(); }
+
+	~persistent_skiplist_iterator()
+	{
+		exit();
+	}
 
 	persistent_skiplist_iterator &operator=(const persistent_skiplist_iterator &other)
 	{
+		if (_epoch != other._epoch) {
+			if (other._epoch)
+				other._epoch->enter();
+			exit();
+			_epoch = other._epoch;
+		}
 		_current_node = other._current_node;
+		_pop = other._pop;
 		return *this;
 	}
 
 	persistent_skiplist_iterator &operator++()
 	{
-		_current_node = _current_node->get_next_ptr(0);
+		_current_node = _current_node->next_visible(_pop);
 		return *this;
 	}
 	persistent_skiplist_iterator operator++(int)
@@ -221,18 +838,191 @@ public:
 	{
 		return &(_current_node->getValue());
 	}
+
+private:
+	void enter()
+	{
+		if (_epoch)
+			_epoch->enter();
+	}
+
+	void exit()
+	{
+		if (_epoch)
+			_epoch->exit();
+	}
+};
+
+/*
+ * Descending iterator. Nodes have no back-links, so the iterator buffers the
+ * run of nodes in front of its position: a refill is one read-only search
+ * that collects the nodes between the predecessor on some level and the
+ * current node. Each refill starts one level higher than the last, which
+ * keeps a backward step amortized O(1). Like forward iterators it holds its
+ * epoch and must stay on one thread.
+ */
+template <typename List, bool is_const>
+class persistent_skiplist_reverse_iterator {
+private:
+	using node_ptr = typename List::node_ptr;
+	friend class persistent_skiplist_reverse_iterator<List, true>;
+
+	List *_list;
+	node_ptr _current;
+	std::vector<node_ptr> _before;
+	bool _bottom;
+	uint8_t _depth;
+public:
+	using iterator_category = std::bidirectional_iterator_tag;
+	using difference_type = ptrdiff_t;
+	using value_type = typename List::value_type;
+	using reference = typename std::conditional<is_const,
+		typename List::const_reference, typename List::reference>::type;
+	using pointer = typename std::conditional<is_const,
+		typename List::const_pointer, typename List::pointer>::type;
+
+	persistent_skiplist_reverse_iterator(List *list, node_ptr node)
+		: _list(list), _current(node), _bottom(false), _depth(1) { enter(); }
+	persistent_skiplist_reverse_iterator(const persistent_skiplist_reverse_iterator &other)
+		: _list(other._list), _current(other._current), _before(other._before),
+		  _bottom(other._bottom), _depth(other._depth) { enter(); }
+	template <typename T = void, typename = typename std::enable_if<is_const, T>::type>
+	persistent_skiplist_reverse_iterator(const persistent_skiplist_reverse_iterator<List, false> &other)
+		: _list(other._list), _current(other._current), _before(other._before),
+		  _bottom(other._bottom), _depth(other._depth) { enter(); }
+
+	~persistent_skiplist_reverse_iterator()
+	{
+		exit();
+	}
+
+	persistent_skiplist_reverse_iterator &operator=(const persistent_skiplist_reverse_iterator &other)
+	{
+		if (_list != other._list) {
+			other.enter();
+			exit();
+		}
+		_list = other._list;
+		_current = other._current;
+		_before = other._before;
+		_bottom = other._bottom;
+		_depth = other._depth;
+		return *this;
+	}
+
+	/* towards smaller keys; the first node steps onto rend() */
+	persistent_skiplist_reverse_iterator &operator++()
+	{
+		while (true) {
+			while (!_before.empty()) {
+				node_ptr node = _before.back();
+				_before.pop_back();
+				if (_list->visible(node)) {
+					_current = node;
+					return *this;
+				}
+			}
+			if (_bottom) {
+				_current = _list->head_node();
+				return *this;
+			}
+			_bottom = _list->collect_before(_current, _before, _depth);
+			if (_depth < List::top_level)
+				_depth++;
+		}
+	}
+	persistent_skiplist_reverse_iterator operator++(int)
+	{
+		persistent_skiplist_reverse_iterator tmp = *this;
+		++*this;
+		return tmp;
+	}
+
+	/* towards larger keys */
+	persistent_skiplist_reverse_iterator &operator--()
+	{
+		if (_current != _list->head_node())
+			_before.push_back(_current);
+		_current = _list->next_node(_current);
+		return *this;
+	}
+	persistent_skiplist_reverse_iterator operator--(int)
+	{
+		persistent_skiplist_reverse_iterator tmp = *this;
+		--*this;
+		return tmp;
+	}
+
+	bool operator==(const persistent_skiplist_reverse_iterator &other) const
+	{
+		return _current == other._current;
+	}
+
+	bool operator!=(const persistent_skiplist_reverse_iterator &other) const
+	{
+		return !(*this == other);
+	}
+
+	reference operator*() const
+	{
+		return _current->getValue();
+	}
+
+	pointer operator->() const
+	{
+		return &(_current->getValue());
+	}
+
+private:
+	void enter() const
+	{
+		_list->epoch()->enter();
+	}
+
+	void exit() const
+	{
+		_list->epoch()->exit();
+	}
 };
 
-template <typename Key, typename T, typename Compare, uint8_t Height, uint8_t Branch>
+template <typename Key, typename T, typename Compare, uint8_t Height, uint8_t Branch, typename Traits>
 class persistent_skiplist_base {
 private:
-	using self_type = persistent_skiplist_base<Key, T, Compare, Height, Branch>;
-	using slnode_type = slnode_t<Key, T>;
+	using self_type = persistent_skiplist_base<Key, T, Compare, Height, Branch, Traits>;
+	using slnode_type = slnode_t<Key, T, Traits>;
 	using key_pptr = persistent_ptr<Key>;
 	// using node_pptr = persistent_ptr<slnode_t>;
 	using node_pptr = ::fourpd::SmartPPtr<slnode_type>;
 	using node_ptr = slnode_type*;
 	using atomic_node_pptr = std::atomic<node_pptr>;
+	using node_array = std::array<node_ptr, Height>;
+	using prefix_type = typename slnode_type::prefix_type;
+	using index_type = volatile_index<slnode_type, (Height > 1 ? Height - 1 : 1)>;
+	using hash_type = volatile_hash<slnode_type>;
+	using stats_type = typename Traits::stats;
+	using persist_type = typename Traits::persist;
+	static constexpr bool hashed = !std::is_same<typename Traits::key_hash, no_key_hash>::value;
+	static constexpr size_t kHashStripes = 64;
+	/* one slab class per node height, the tail's 0 included */
+	using slab_type = slab_allocator<Height + 1>;
+	using slab_root = typename std::conditional<Traits::slab_allocator,
+		typename slab_type::root, no_slab_root>::type;
+
+	template <typename, bool>
+	friend class persistent_skiplist_reverse_iterator;
+
+	static_assert(!Traits::hybrid_index || Height > 1, "hybrid_index needs at least two levels");
+	static_assert(!Traits::hybrid_index || !Traits::indexable, "indexable needs the upper levels in pmem");
+	static_assert(!Traits::versioned || !Traits::indexable, "spans would have to count versions");
+	static_assert(!Traits::slab_allocator || Traits::inline_tower, "a slab slot holds the node and its tower");
+	/* highest level searched in pmem */
+	static constexpr int top_level = Traits::hybrid_index ? 0 : Height - 1;
+	/* tags retired DRAM index entries among retired pmem offsets */
+	static constexpr uint64_t kVolatileRetire = 1;
+	/* tags the offsets of retired out_of_line values */
+	static constexpr uint64_t kValueRetire = 2;
+	/* tags retired DRAM blocks of the hash index */
+	static constexpr uint64_t kHashRetire = kVolatileRetire | kValueRetire;
 public:
 	using value_type = typename slnode_type::value_type;
 	using key_type = typename slnode_type::key_type;
@@ -248,17 +1038,56 @@ public:
 
 	using iterator = persistent_skiplist_iterator<slnode_type, false>;
 	using const_iterator = persistent_skiplist_iterator<slnode_type, true>;
+	using reverse_iterator = persistent_skiplist_reverse_iterator<self_type, false>;
+	using const_reverse_iterator = persistent_skiplist_reverse_iterator<self_type, true>;
+
+	/* whether update(), insert_or_assign() and upsert() are available: a
+	 * value is replaced only where readers cannot see it half written */
+	static constexpr bool atomic_update = Traits::versioned ||
+		is_out_of_line<mapped_type>::value || is_atomic_word<mapped_type>::value;
+
+	/* Point-in-time view of a versioned list for find() and scan(). The
+	 * versions it sees are kept until it is destroyed. Unlike iterators it
+	 * holds no epoch and may be passed between threads. */
+	class snapshot_type {
+	public:
+		snapshot_type(snapshot_type &&other) : _list(other._list), _ts(other._ts) {
+			other._list = nullptr;
+		}
+		snapshot_type(const snapshot_type &) = delete;
+		snapshot_type &operator=(const snapshot_type &) = delete;
+		~snapshot_type() {
+			if (_list)
+				_list->release_snapshot(_ts);
+		}
+		uint64_t timestamp() const {
+			return _ts;
+		}
+	private:
+		friend class persistent_skiplist_base;
+		snapshot_type(self_type *list, uint64_t ts) : _list(list), _ts(ts) {}
+		self_type *_list;
+		uint64_t _ts;
+	};
 
-	persistent_skiplist_base() : 
-		_random((unsigned long)std::chrono::system_clock::now().time_since_epoch().count()) {
+	persistent_skiplist_base() {
+		static_assert(!std::is_empty<key_compare>::value || sizeof(self_type) ==
+			2 * sizeof(node_pptr) + sizeof(uint64_t) + sizeof(std::mt19937_64) + sizeof(size_type),
+			"the object must keep the size of the original layout");
 		assert(pmemobj_tx_stage() == TX_STAGE_WORK);
+		create_runtime();
+		if (Traits::slab_allocator)
+			attach_slabs();
 		_head.store(allocate_node(Height), std::memory_order_relaxed);
 		LOG4P_DEBUG("_head = %x", _head.load().getOffset());
 		_tail = allocate_node(0);
 		LOG4P_DEBUG("_tail = %x", _tail.getOffset());
-		for (uint8_t i = 0;i < Height;i++) {
-			_head.load().getVptr(get_objpool())->set_next_pptr(i, _tail);
-			LOG4P_DEBUG("_head->next_pptr[%d] = %x", i, _head.load().getVptr(get_objpool())->get_next_pptr(i).getOffset());
+		PMEMobjpool *pop = get_objpool();
+		for (uint8_t i = 0;i < _head.load().getVptr(pop)->levels();i++) {
+			_head.load().getVptr(pop)->set_next_pptr(i, _tail);
+			if (Traits::indexable)
+				_head.load().getVptr(pop)->set_span(i, 1);
+			LOG4P_DEBUG("_head->next_pptr[%d] = %x", i, _head.load().getVptr(pop)->load_next_pptr(i).getOffset());
 		}
 		_size = 0;
 	}
@@ -267,118 +1096,477 @@ public:
 
 	}
 
-	template <typename K, typename M>
-	std::pair<iterator, bool> try_emplace(K &&key, M &&obj) {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		if (res.second) { //key found {
-			LOG4P_DEBUG("key found");
-			return std::pair<iterator, bool>(iterator(res.first), false);
-		} else {
-			LOG4P_DEBUG("key NOT found");
-			return internal_insert(pre, std::forward<K>(key), std::forward<M>(obj));
-		}
-	}
+	/* what recover() found and fixed */
+	struct recovery_stats {
+		size_type nodes;          /* elements left, the new size() */
+		size_type dirty_links;    /* links still carrying kDirtyFlag */
+		size_type repaired_links; /* links that led to the wrong node */
+		size_type dropped;        /* erased nodes unlinked and freed */
+		unsigned partitions;
+		std::chrono::milliseconds elapsed;
+	};
 
-	template <typename K>
-	iterator find(const K &key) {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		LOG4P_DEBUG("result {node=%p, found=%d}", (void*)res.first, res.second);
-		return res.second ? 
-				iterator(res.first) :
-				end();
+	/* Volatile state (epochs, ...) lives in DRAM and has to be rebuilt every
+	 * time the pool is opened, before any other method is called. Calling it,
+	 * or recover(), again before runtime_finalize() throws std::logic_error. */
+	void runtime_initialize() {
+		create_runtime();
+		if (Traits::slab_allocator)
+			rebuild_slabs();
+		if (Traits::hybrid_index || hashed)
+			rebuild_index();
+		if (Traits::versioned)
+			recover_versions();
+		if (Traits::indexable)
+			rebuild_spans();
+	}
+
+	/* runtime_initialize() after an unclean shutdown. Level 0 is walked in
+	 * up to @threads partitions, split at nodes of a sparse upper level.
+	 * Erased (and hidden) nodes are unlinked and freed, every other link
+	 * is made to point to the next node of its level with kDirtyFlag
+	 * cleared, so half-linked towers are completed; only links that change
+	 * are flushed. size(), spans and the DRAM index are recomputed on the
+	 * way. Must not run concurrently with anything else. */
+	recovery_stats recover(unsigned threads = std::thread::hardware_concurrency()) {
+		auto start = std::chrono::steady_clock::now();
+		create_runtime();
+		if (Traits::slab_allocator) {
+			attach_slabs();
+			_runtime->slabs.begin_rebuild();
+		}
+		PMEMobjpool *pop = get_objpool();
+		node_ptr head = head_node();
+		std::vector<node_ptr> bounds = recovery_bounds(std::max(1u, threads));
+		std::vector<recovery_part> parts(bounds.size());
+		std::vector<std::thread> workers;
+		for (size_t i = 1; i < parts.size(); i++)
+			workers.emplace_back([&, i] { recover_part(parts[i], bounds[i], i + 1 < bounds.size() ? bounds[i + 1] : nullptr); });
+		recover_part(parts[0], head, bounds.size() > 1 ? bounds[1] : nullptr);
+		for (auto &w : workers)
+			w.join();
+
+		/* stitch the partitions together behind _head */
+		recovery_stats stats{0, 0, 0, 0, unsigned(parts.size()), std::chrono::milliseconds(0)};
+		node_array last;
+		last.fill(head);
+		std::array<size_type, Height> last_rank{};
+		uint64_t newest = 0;
+		std::vector<typename index_type::entry> entries;
+		std::vector<std::pair<uint64_t, node_ptr>> hashes;
+		for (auto &part : parts) {
+			for (uint8_t lv = 0; lv < head->levels(); lv++) {
+				if (!part.first[lv])
+					continue;
+				stats.repaired_links += recover_link(last[lv], lv, part.first[lv], stats.dirty_links);
+				if (Traits::indexable)
+					last[lv]->set_span(lv, stats.nodes + part.first_rank[lv] - last_rank[lv]);
+				last[lv] = part.last[lv];
+				last_rank[lv] = stats.nodes + part.last_rank[lv];
+			}
+			stats.nodes += part.count;
+			stats.dirty_links += part.dirty;
+			stats.repaired_links += part.repaired;
+			stats.dropped += part.dropped.size();
+			newest = std::max(newest, part.newest);
+			entries.insert(entries.end(), part.entries.begin(), part.entries.end());
+			hashes.insert(hashes.end(), part.hashes.begin(), part.hashes.end());
+		}
+		for (uint8_t lv = 0; lv < head->levels(); lv++) {
+			stats.repaired_links += recover_link(last[lv], lv, _tail.getVptr(pop), stats.dirty_links);
+			if (Traits::indexable)
+				last[lv]->set_span(lv, stats.nodes + 1 - last_rank[lv]);
+		}
+		persist_type::drain(pop);
+		if (Traits::slab_allocator) {
+			_runtime->slabs.mark_used(head);
+			_runtime->slabs.mark_used(_tail.getVptr(pop));
+			_runtime->slabs.end_rebuild();
+		}
+
+		for (auto &part : parts) {
+			std::vector<uint64_t> batch;
+			for (node_ptr node : part.dropped) {
+				batch.push_back(to_pptr(node).getOffset());
+				if (batch.size() == kBulkChunk) {
+					free_nodes(batch);
+					batch.clear();
+				}
+			}
+			if (!batch.empty())
+				free_nodes(batch);
+		}
+		_size.store(stats.nodes, std::memory_order_relaxed);
+		_runtime->clock.store(newest);
+		_runtime->committed.store(newest);
+		if (Traits::hybrid_index)
+			_runtime->index.build(entries, std::max(1u, threads));
+		if (hashed)
+			_runtime->hash.build(hashes);
+		stats.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start);
+		LOG4P_DEBUG("recovered %zu nodes in %u partitions", stats.nodes, stats.partitions);
+		return stats;
+	}
+
+	/* Frees every retired node and releases the volatile state. The caller
+	 * must ensure no other thread is using the skiplist. */
+	void runtime_finalize() {
+		{
+			std::lock_guard<std::mutex> lock(runtime_lock());
+			if (live_runtimes().erase(this) == 0)
+				return;
+		}
+		stop_expiry();
+		delete _runtime;
+		_runtime = nullptr;
+	}
+
+	template <typename K, typename M>
+	std::pair<iterator, bool> try_emplace(K &&key, M &&obj) {
+		epoch_guard guard(epoch());
+		auto lock = write_lock();
+		durable_scope scope(this);
+		node_array pre, succ;
+		if (find_position(key, pre, succ))
+			return std::pair<iterator, bool>(iterator(succ[0], get_objpool(), epoch()), false);
+		return internal_insert(pre, succ, std::forward<K>(key), std::forward<M>(obj));
+	}
+
+	/* Inserts @obj under @key, or replaces the value if @key is present;
+	 * the flag is true if it was inserted. See update(). */
+	template <typename K, typename M>
+	std::pair<iterator, bool> insert_or_assign(const K &key, M &&obj) {
+		epoch_guard guard(epoch());
+		return internal_upsert(key, &obj, [&](const T &) -> const M & { return obj; });
+	}
+
+	/* Replaces the value of @key; false if @key is not present. */
+	template <typename K, typename M>
+	bool assign(const K &key, M &&obj) {
+		return update(key, [&](const T &) -> const M & { return obj; });
+	}
+
+	/* Replaces the value of @key with @fn(value); false if @key is not
+	 * present. Values that are a naturally aligned word of up to 8 bytes
+	 * are replaced by a CAS and one persist, without a transaction, and
+	 * @fn may run more than once. An out_of_line value is replaced by a
+	 * CAS of its offset, the old one is freed once no reader can hold it.
+	 * Both are atomic read-modify-writes. Versioned lists link a new
+	 * version and hide the old one with the same stamp, so every snapshot
+	 * sees exactly one of them. Other values cannot be replaced without
+	 * tearing for lock-free readers, see atomic_update. */
+	template <typename K, typename F>
+	bool update(const K &key, F &&fn) {
+		epoch_guard guard(epoch());
+		return internal_upsert(key, static_cast<const T *>(nullptr), fn).second;
+	}
+
+	/* Merge-operator upsert: inserts @operand if @key is not present, else
+	 * replaces the value with @merge(value, @operand) like update(). The
+	 * flag is true if @operand was inserted. */
+	template <typename K, typename M, typename F>
+	std::pair<iterator, bool> upsert(const K &key, M &&operand, F &&merge) {
+		epoch_guard guard(epoch());
+		return internal_upsert(key, &operand, [&](const T &value) { return merge(value, operand); });
+	}
+
+	/* Inserts the elements of [first, last) whose keys are not present yet and
+	 * returns how many were added; among equal keys in the range the first
+	 * wins. The range is sorted and linked in chunks of kBatchChunk nodes,
+	 * each allocated in one transaction and made durable with three drains. */
+	template <typename ForwardIt>
+	size_type insert_batch(ForwardIt first, ForwardIt last) {
+		return internal_insert_batch(first, last, std::false_type());
+	}
+
+	/* insert_batch() that moves keys and values out of the range */
+	template <typename ForwardIt>
+	size_type emplace_batch(ForwardIt first, ForwardIt last) {
+		return internal_insert_batch(first, last, std::true_type());
+	}
+
+	/* Appends the ascending range [first, last) to an empty list without
+	 * searching, keeping the rightmost node of every level. Each chunk of
+	 * kBulkChunk nodes is allocated in one transaction and made durable with
+	 * three drains, so a crash leaves a loaded prefix. Must not run
+	 * concurrently with other calls.
+	 *
+	 * Returns the number of nodes loaded: keys equal to their predecessor
+	 * are skipped and not counted. Throws std::logic_error if the list holds
+	 * any node, old versions included, and std::invalid_argument at the
+	 * first key smaller than its predecessor; the keys before it stay
+	 * loaded then. */
+	template <typename InputIt>
+	size_type bulk_load(InputIt first, InputIt last) {
+		epoch_guard guard(epoch());
+		auto lock = write_lock();
+		PMEMobjpool *pop = get_objpool();
+		pool_base pb = get_pool_base();
+		node_ptr head = _head.load(std::memory_order_relaxed).getVptr(pop);
+		if (!head->load_next_ptr(pop, 0)->isTail())
+			throw std::logic_error("bulk_load() needs an empty skiplist");
+		node_array rightmost, chunk_first, chunk_last;
+		rightmost.fill(head);
+		std::array<size_type, Height> last_rank{};
+		std::vector<node_ptr> chunk;
+		std::vector<typename index_type::entry> entries;
+		std::vector<std::pair<uint64_t, node_ptr>> hashes;
+		size_type loaded = 0;
+		/* versioned: the whole load is one write */
+		version_stamp stamp(this);
+		uint64_t ts = stamp.ts();
+		bool unsorted = false;
+		while (first != last && !unsorted) {
+			chunk.clear();
+			run_transaction(pb, [&] {
+				for (; first != last && chunk.size() < kBulkChunk; ++first) {
+					auto &&item = *first;
+					node_ptr prev = chunk.empty() ? rightmost[0] : chunk.back();
+					if (prev != head && !_compare(prev->getKey(), item.first)) {
+						/* the chunk so far is still linked below */
+						unsorted = _compare(item.first, prev->getKey());
+						if (unsorted)
+							break;
+						continue;
+					}
+					chunk.push_back(allocate_unflushed(random_height(),
+						std::forward<decltype(item)>(item).first,
+						std::forward<decltype(item)>(item).second).getVptr(pop));
+				}
+			});
+
+			/* chain the chunk privately, then hang it off the rightmost nodes */
+			chunk_first.fill(nullptr);
+			size_type rank = loaded;
+			for (node_ptr node : chunk) {
+				rank++;
+				node->set_created(ts);
+				for (uint8_t lv = 0; lv < node->levels(); lv++) {
+					node->set_next_pptr(lv, _tail);
+					if (Traits::indexable) {
+						(chunk_first[lv] ? chunk_last[lv] : rightmost[lv])->set_span(lv, rank - last_rank[lv]);
+						last_rank[lv] = rank;
+					}
+					if (chunk_first[lv])
+						chunk_last[lv]->set_next_pptr(lv, to_pptr(node));
+					else
+						chunk_first[lv] = node;
+					chunk_last[lv] = node;
+				}
+				node->flush_node(pop);
+				if (Traits::hybrid_index && node->height() > 1)
+					entries.push_back({node, node->key_prefix(), uint8_t(node->height() - 1)});
+				if (hashed)
+					hashes.emplace_back(key_hash(node->getKey()), node);
+			}
+			persist_type::drain(pop);
+			/* level 0 first: an upper link must never lead to an unlinked node */
+			for (uint8_t lv = 0; lv < Height; lv++) {
+				if (!chunk_first[lv])
+					continue;
+				rightmost[lv]->set_next_pptr(lv, to_pptr(chunk_first[lv]));
+				rightmost[lv]->flush_next(pop, lv);
+				rightmost[lv] = chunk_last[lv];
+				if (lv == 0)
+					persist_type::drain(pop);
+			}
+			persist_type::drain(pop);
+			_size.fetch_add(chunk.size(), std::memory_order_relaxed);
+			loaded += chunk.size();
+		}
+		if (Traits::hybrid_index)
+			_runtime->index.build(entries, std::thread::hardware_concurrency());
+		if (hashed)
+			_runtime->hash.build(hashes);
+		for (uint8_t lv = 0; Traits::indexable && lv < Height; lv++)
+			rightmost[lv]->set_span(lv, loaded + 1 - last_rank[lv]);
+		stamp.commit();
+		LOG4P_DEBUG("bulk loaded %zu nodes", loaded);
+		if (unsorted)
+			throw std::invalid_argument("bulk_load() input is not sorted");
+		return loaded;
+	}
+
+	template <typename K>
+	iterator find(const K &key) {
+		epoch_guard guard(epoch());
+		if (hashed) {
+			node_ptr node = hash_lookup(key);
+			return node ? iterator(node, get_objpool(), epoch()) : end();
+		}
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		return res.second ? 
+				iterator(res.first, get_objpool(), epoch()) :
+				end();
 	}
 
 	template <typename K>
 	const_iterator find(const K &key) const {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		LOG4P_DEBUG("result {node=%p, found=%d}", (void*)res.first, res.second);
+		epoch_guard guard(epoch());
+		if (hashed) {
+			node_ptr node = const_cast<self_type *>(this)->hash_lookup(key);
+			return node ? const_iterator(node, get_objpool(), epoch()) : cend();
+		}
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
 		return res.second ? 
-				const_iterator(res.first) :
+				const_iterator(res.first, get_objpool(), epoch()) :
 				cend();
 	}
 	template <typename K>
 	iterator lower_bound(const K &key) {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		if (res.second)
-			return iterator(res.first);
-		else {
-			node_ptr next = res.first->get_next_ptr(0);
-			if (next->isTail())
-				return end();
-			else
-				return iterator(next);
-		}
+		epoch_guard guard(epoch());
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		node_ptr node = res.second ? res.first : next_node(res.first);
+		return node->isTail() ? end() : iterator(node, get_objpool(), epoch());
 	}
 
 	template <typename K>
 	const_iterator lower_bound(const K &key) const {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		if (res.second)
-			return const_iterator(res.first);
-		else {
-			node_ptr next = res.first->get_next_ptr(0);
-			if (next->isTail())
-				return cend();
-			else
-				return const_iterator(next);
-		}
+		epoch_guard guard(epoch());
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		node_ptr node = res.second ? res.first : next_node(res.first);
+		return node->isTail() ? cend() : const_iterator(node, get_objpool(), epoch());
 	}
 
 	template <typename K>
 	iterator upper_bound(const K &key) {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		node_ptr next = res.first->get_next_ptr(0);
+		epoch_guard guard(epoch());
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		uint64_t prefix = prefix_type::of(key);
+		node_ptr next = next_node(res.first);
 		while (!next->isTail()) {
-			if (_compare(key, next->getKey()))
-				return iterator(next);
-			next = next->get_next_ptr(0);
+			if (key_less(key, prefix, next))
+				return iterator(next, get_objpool(), epoch());
+			next = next_node(next);
 		}
 		return end();
 	}
 
 	template <typename K>
 	const_iterator upper_bound(const K &key) const {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		node_ptr next = res.first->get_next_ptr(0);
+		epoch_guard guard(epoch());
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		uint64_t prefix = prefix_type::of(key);
+		node_ptr next = next_node(res.first);
 		while (!next->isTail()) {
-			if (_compare(key, next->getKey()))
-				return const_iterator(next);
-			next = next->get_next_ptr(0);
+			if (key_less(key, prefix, next))
+				return const_iterator(next, get_objpool(), epoch());
+			next = next_node(next);
 		}
 		return cend();
 	}
 
 	template <typename K>
 	size_type erase(const K &key) {
-		std::vector<node_ptr> pre(Height);
-		std::pair<node_ptr, bool> res = find_less_or_equal(key, pre);
-		if (res.second) { //key found
-			LOG4P_DEBUG("key found");
-			return internal_erase(pre, res.first);
-		} else {
-			LOG4P_DEBUG("key NOT found");
-			return size_type(0);
-		}
+		epoch_guard guard(epoch());
+		auto lock = write_lock();
+		durable_scope scope(this);
+		node_array pre, succ;
+		if (find_position(key, pre, succ))
+			return internal_erase(pre, succ, succ[0]);
+		return size_type(0);
 	}
 	
+	/* Removes every element whose key is below @cutoff, meant for keys that
+	 * grow with time. The expired prefix is marked in one pass sharing one
+	 * drain, the run of marked nodes is cut off each level with one CAS, and
+	 * the epoch manager frees the nodes in batched transactions. Returns
+	 * the number of elements removed. */
+	template <typename K>
+	size_type expire_before(const K &cutoff) {
+		static_assert(!Traits::versioned, "snapshots may still see expired elements");
+		epoch_guard guard(epoch());
+		auto lock = write_lock();
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(cutoff);
+		node_ptr head = head_node();
+		std::array<size_type, Height> spans{};
+		if (Traits::indexable) {
+			node_array pre, succ;
+			find_position(cutoff, pre, succ);
+			for (uint8_t lv = 0; lv < Height; lv++)
+				spans[lv] = _runtime->ranks[lv] + pre[lv]->span(lv) - _runtime->ranks[0];
+		}
+
+		std::vector<std::pair<node_ptr, uint8_t>> marks;
+		std::vector<node_ptr> expired;
+		for (node_ptr node = head->load_next_ptr(pop, 0); !node->isTail() && node_less(node, cutoff, prefix);
+		     node = node->load_next_ptr(pop, 0)) {
+			for (int lv = node->levels() - 1; lv >= 1; lv--) {
+				if (node->publish_mark(pop, lv))
+					marks.emplace_back(node, lv);
+			}
+			if (Traits::hybrid_index && node->height() > 1)
+				index_remove(node);
+			if (node->publish_mark(pop, 0)) {
+				marks.emplace_back(node, 0);
+				expired.push_back(node);
+			}
+		}
+		if (expired.empty())
+			return 0;
+		persist_type::drain(pop);
+		for (auto &m : marks)
+			m.first->settle_mark(m.second);
+
+		unlink_marked_before(cutoff, prefix);
+		for (uint8_t lv = 0; Traits::indexable && lv < Height; lv++)
+			head->set_span(lv, spans[lv]);
+		for (node_ptr node : expired) {
+			if (hashed)
+				hash_remove(node);
+			retire_node(node);
+		}
+		_size.fetch_sub(expired.size(), std::memory_order_relaxed);
+		LOG4P_DEBUG("expired %zu nodes", expired.size());
+		return expired.size();
+	}
+
+	/* Calls expire_before(cutoff()) every @period on a background thread,
+	 * which also reclaims what it retired, until stop_expiry() or
+	 * runtime_finalize(). */
+	template <typename F>
+	void start_expiry(F cutoff, std::chrono::milliseconds period) {
+		stop_expiry();
+		_runtime->expiry_stop = false;
+		_runtime->expiry = std::thread([this, cutoff, period]() mutable {
+			std::unique_lock<std::mutex> lock(_runtime->expiry_lock);
+			while (!_runtime->expiry_cv.wait_for(lock, period, [this] { return _runtime->expiry_stop; })) {
+				lock.unlock();
+				expire_before(cutoff());
+				reclaim();
+				lock.lock();
+			}
+		});
+	}
+
+	void stop_expiry() {
+		if (!_runtime->expiry.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(_runtime->expiry_lock);
+			_runtime->expiry_stop = true;
+		}
+		_runtime->expiry_cv.notify_all();
+		_runtime->expiry.join();
+	}
+
 	iterator begin() {
-		return iterator(_head.load(std::memory_order_relaxed).getVptr(get_objpool())->get_next_ptr(0));
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		return iterator(_head.load(std::memory_order_relaxed).getVptr(pop)->next_visible(pop), pop, epoch());
 	}
 	iterator end() {
-		return iterator(_tail.getVptr(get_objpool()));
+		return iterator(_tail.getVptr(get_objpool()), get_objpool(), epoch());
 	}
 	const_iterator begin() const {
-		return const_iterator(_head.load(std::memory_order_relaxed).getVptr(get_objpool())->get_next_ptr(0));
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		return const_iterator(_head.load(std::memory_order_relaxed).getVptr(pop)->next_visible(pop), pop, epoch());
 	}
 	const_iterator end() const {
-		return const_iterator(_tail.getVptr(get_objpool()));
+		return const_iterator(_tail.getVptr(get_objpool()), get_objpool(), epoch());
 	}
 	const_iterator cbegin() const {
 		return begin();
@@ -386,33 +1574,170 @@ public:
 	const_iterator cend() const {
 		return end();
 	}
+
+	reverse_iterator rbegin() {
+		return ++reverse_iterator(this, _tail.getVptr(get_objpool()));
+	}
+	reverse_iterator rend() {
+		return reverse_iterator(this, head_node());
+	}
+	const_reverse_iterator rbegin() const {
+		return const_cast<self_type *>(this)->rbegin();
+	}
+	const_reverse_iterator rend() const {
+		return const_cast<self_type *>(this)->rend();
+	}
+	const_reverse_iterator crbegin() const {
+		return rbegin();
+	}
+	const_reverse_iterator crend() const {
+		return rend();
+	}
+
+	/* first element in descending order that is not greater than @key */
+	template <typename K>
+	reverse_iterator rlower_bound(const K &key) {
+		epoch_guard guard(epoch());
+		node_ptr node = find_less_or_equal(key).first;
+		reverse_iterator it(this, node);
+		/* the predecessor may be a hidden version */
+		if (!visible(node))
+			++it;
+		return it;
+	}
+
+	/* Calls @f on the elements in [lo, hi] in key order, after skipping the
+	 * first @offset of them, until @f returns false or @limit elements were
+	 * visited. Returns the number of elements visited. Nodes are prefetched
+	 * ahead of the walk, see scan_prefetcher. */
+	template <typename K, typename F>
+	size_type scan(const K &lo, const K &hi, size_type offset, size_type limit, F &&f) {
+		return scan_if(lo, hi, offset, limit, [](node_ptr node) { return !node->hidden(); },
+			std::forward<F>(f));
+	}
+
+	template <typename K, typename F>
+	size_type scan(const K &lo, const K &hi, F &&f) {
+		return scan(lo, hi, 0, std::numeric_limits<size_type>::max(), std::forward<F>(f));
+	}
+
+	/* scan() of the elements [lo, hi] as they were when @snap was taken */
+	template <typename K, typename F>
+	size_type scan(const K &lo, const K &hi, const snapshot_type &snap, F &&f) {
+		static_assert(Traits::versioned, "snapshots need versioned traits");
+		uint64_t ts = snap.timestamp();
+		return scan_if(lo, hi, 0, std::numeric_limits<size_type>::max(),
+			[ts](node_ptr node) { return node->visible_at(ts); }, std::forward<F>(f));
+	}
+
+	/* Takes a snapshot of a versioned list: it sees every write that was
+	 * committed before, and none that commits later. */
+	snapshot_type snapshot() {
+		static_assert(Traits::versioned, "snapshots need versioned traits");
+		std::lock_guard<std::mutex> lock(_runtime->versions);
+		uint64_t ts = _runtime->committed.load(std::memory_order_acquire);
+		_runtime->snapshots.insert(ts);
+		return snapshot_type(this, ts);
+	}
+
+	/* the element @key had in @snap, or nullptr; valid as long as @snap */
+	template <typename K>
+	const_pointer find(const K &key, const snapshot_type &snap) {
+		static_assert(Traits::versioned, "snapshots need versioned traits");
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(key);
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		/* the versions of a key are adjacent, newest first */
+		node_ptr node = res.second ? res.first : res.first->load_next_ptr(pop, 0);
+		for (; !node->isTail() && !key_less(key, prefix, node); node = node->load_next_ptr(pop, 0)) {
+			if (!node_less(node, key, prefix) && node->visible_at(snap.timestamp()))
+				return &node->getValue();
+		}
+		return nullptr;
+	}
+
+	/* Calls @f on the elements in [lo, hi] from the largest key down, until
+	 * @f returns false. Returns the number of elements visited. */
+	template <typename K, typename F>
+	size_type reverse_range_scan(const K &lo, const K &hi, F &&f) {
+		size_type visited = 0;
+		for (auto it = rlower_bound(hi); it != rend() && !_compare(it->first, lo); ++it) {
+			visited++;
+			if (!f(*it))
+				break;
+		}
+		return visited;
+	}
 	
 	/* method */
 
 	size_type size() const noexcept {
-		return _size.get_ro();
+		return _size.load(std::memory_order_relaxed);
+	}
+
+	/* hot-path counters of every list with the same stats option */
+	stats_snapshot stats() const {
+		return stats_type::snapshot();
+	}
+
+	/* number of erased nodes waiting for their epoch to expire */
+	size_type retired_size() const noexcept {
+		return _runtime->epoch.retired();
+	}
+
+	/* free the retired nodes of the calling thread that are no longer visible */
+	size_type reclaim() {
+		return _runtime->epoch.collect();
 	}
 
+	/* element at position @pos < size(); indexable lists find it through
+	 * the spans, others walk level 0. Neither takes the writer lock. */
 	reference operator[](size_type pos) {
-		node_ptr temp = _head.load(std::memory_order_relaxed).getVptr(get_objpool())->get_next_ptr(0);
-		while (!temp->isTail()) {
-			if (pos == 0)
-				return temp->getValue();
-			temp = temp->get_next_ptr(0);
-			pos--;
-		}
-		assert(false);
+		epoch_guard guard(epoch());
+		return position_node(pos, std::integral_constant<bool, Traits::indexable>())->getValue();
 	}
 
 	const_reference operator[](size_type pos) const {
-		node_ptr temp = _head.load(std::memory_order_relaxed).getVptr(get_objpool())->get_next_ptr(0);
-		while (!temp->isTail()) {
-			if (pos == 0)
-				return temp->getValue();
-			temp = temp->get_next_ptr(0);
-			pos--;
-		}
-		assert(false);
+		epoch_guard guard(epoch());
+		return position_node(pos, std::integral_constant<bool, Traits::indexable>())->getValue();
+	}
+
+	/* number of keys less than @key, i.e. the position of @key if present */
+	template <typename K>
+	size_type rank(const K &key) {
+		static_assert(Traits::indexable, "rank() needs indexable traits");
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(key);
+		return read_spans([&] {
+			node_ptr node = _head.load(std::memory_order_relaxed).getVptr(pop);
+			size_type rank = 0;
+			for (int level = Height - 1; level >= 0; level--) {
+				node_ptr next = node->load_next_ptr(pop, level);
+				while (!next->isTail() && node_less(next, key, prefix)) {
+					rank += node->span(level);
+					node = next;
+					next = node->load_next_ptr(pop, level);
+				}
+			}
+			return rank;
+		});
+	}
+
+	/* iterators to the positions [lo, hi), clamped to size() */
+	std::pair<iterator, iterator> range_by_index(size_type lo, size_type hi) {
+		static_assert(Traits::indexable, "range_by_index() needs indexable traits");
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		return read_spans([&] {
+			size_type n = size();
+			size_type end_pos = std::min(hi, n);
+			if (lo >= end_pos)
+				return std::pair<iterator, iterator>(end(), end());
+			iterator last = end_pos == n ? end() : iterator(select_node(end_pos), pop, epoch());
+			return std::pair<iterator, iterator>(iterator(select_node(lo), pop, epoch()), last);
+		});
 	}
 
 	key_compare &key_comp() {
@@ -423,145 +1748,1676 @@ public:
 	}
 
 private:
+	using epoch_guard = ::fourpd::EpochManager::Guard;
+
+	static constexpr size_t kBatchChunk = 256;
+	static constexpr size_t kScanAhead = 16;
+
+	/* Level-0 nodes arrive one dependent miss at a time, so a scan keeps a
+	 * runner roughly kScanAhead nodes in front of it that hops along level 1
+	 * where it can and prefetches every node it lands on. */
+	class scan_prefetcher {
+	public:
+		scan_prefetcher(self_type *list, node_ptr start)
+			: _list(list), _runner(start), _gap(0) {}
+
+		/* the consumer moved one node further */
+		void advance(PMEMobjpool *pop) {
+			if (_gap > 0)
+				_gap--;
+			while (_gap < kScanAhead && !_runner->isTail()) {
+				if (_runner->levels() > 1) {
+					_runner = _runner->load_next_ptr(pop, 1);
+					_gap += Branch;
+				} else {
+					_runner = _list->next_node(_runner);
+					_gap++;
+				}
+				_runner->prefetch();
+			}
+		}
+	private:
+		self_type *_list;
+		node_ptr _runner;
+		size_t _gap;
+	};
+	static constexpr size_t kBulkChunk = 4096;
+
+	/* scan() over the nodes for which @show holds */
+	template <typename K, typename Show, typename F>
+	size_type scan_if(const K &lo, const K &hi, size_type offset, size_type limit, Show &&show, F &&f) {
+		epoch_guard guard(epoch());
+		PMEMobjpool *pop = get_objpool();
+		uint64_t lo_prefix = prefix_type::of(lo);
+		uint64_t prefix = prefix_type::of(hi);
+		std::pair<node_ptr, bool> res = find_less_or_equal(lo);
+		node_ptr node = res.second ? res.first : res.first->load_next_ptr(pop, 0);
+		scan_prefetcher ahead(this, node);
+		size_type visited = 0;
+		while (!node->isTail() && visited < limit && !key_less(hi, prefix, node)) {
+			node_pptr after = node->load_next_pptr(0);
+			node_ptr next = after.getVptr(pop);
+			next->prefetch_entry();
+			ahead.advance(pop);
+			if (!after.isDelete() && !node_less(node, lo, lo_prefix) && show(node)) {
+				if (offset > 0) {
+					offset--;
+				} else {
+					visited++;
+					if (!f(static_cast<const_reference>(node->getValue())))
+						break;
+				}
+			}
+			node = next;
+		}
+		return visited;
+	}
+
+	/* the share of one recover() thread: the first and last node it kept on
+	 * every level, with their positions inside the partition */
+	struct recovery_part {
+		node_array first, last;
+		std::array<size_type, Height> first_rank, last_rank;
+		size_type count, dirty, repaired;
+		uint64_t newest;
+		std::vector<node_ptr> dropped;
+		std::vector<typename index_type::entry> entries;
+		std::vector<std::pair<uint64_t, node_ptr>> hashes;
+	};
+
+	/* _head followed by live nodes splitting level 0 into about @threads
+	 * runs, taken from the highest level that has enough of them. A node
+	 * whose upper link is not marked is linked on level 0 as well. */
+	std::vector<node_ptr> recovery_bounds(unsigned threads) {
+		PMEMobjpool *pop = get_objpool();
+		std::vector<node_ptr> bounds{head_node()};
+		if (threads == 1 || top_level == 0)
+			return bounds;
+		std::vector<node_ptr> nodes;
+		for (int lv = top_level; lv >= 1; lv--) {
+			nodes.clear();
+			for (node_ptr node = head_node()->load_next_ptr(pop, lv); !node->isTail(); node = node->load_next_ptr(pop, lv)) {
+				if (!node->load_next_pptr(lv).isDelete() && !node->hidden())
+					nodes.push_back(node);
+			}
+			if (nodes.size() >= threads * 4)
+				break;
+		}
+		size_t step = std::max<size_t>(1, nodes.size() / threads);
+		for (size_t i = step; i < nodes.size() && bounds.size() < threads; i += step)
+			bounds.push_back(nodes[i]);
+		return bounds;
+	}
+
+	/* recover() of the nodes from @start up to @stop (excluded, nullptr for
+	 * the tail); _head or the boundary node @start itself is live */
+	void recover_part(recovery_part &part, node_ptr start, node_ptr stop) {
+		PMEMobjpool *pop = get_objpool();
+		part.first.fill(nullptr);
+		part.last.fill(nullptr);
+		part.count = part.dirty = part.repaired = 0;
+		part.newest = 0;
+		node_ptr node = start == head_node() ? start->load_next_ptr(pop, 0) : start;
+		while (!node->isTail() && node != stop) {
+			node_ptr next = node->load_next_ptr(pop, 0);
+			if (Traits::slab_allocator)
+				_runtime->slabs.mark_used(node);
+			part.newest = std::max(part.newest, std::max(node->created(), node->deleted()));
+			if (node->load_next_pptr(0).isDelete() || node->hidden()) {
+				part.dropped.push_back(node);
+				node = next;
+				continue;
+			}
+			part.count++;
+			node->reset_linking();
+			for (uint8_t lv = 0; lv < node->levels(); lv++) {
+				if (part.last[lv]) {
+					part.repaired += recover_link(part.last[lv], lv, node, part.dirty);
+					if (Traits::indexable)
+						part.last[lv]->set_span(lv, part.count - part.last_rank[lv]);
+				} else {
+					part.first[lv] = node;
+					part.first_rank[lv] = part.count;
+				}
+				part.last[lv] = node;
+				part.last_rank[lv] = part.count;
+			}
+			if (Traits::hybrid_index && node->height() > 1)
+				part.entries.push_back({node, node->key_prefix(), uint8_t(node->height() - 1)});
+			if (hashed)
+				part.hashes.emplace_back(key_hash(node->getKey()), node);
+			node = next;
+		}
+		persist_type::drain(pop);
+	}
+
+	/* points the link of @node at @lv to @next without flags, flushing it
+	 * if it changes; returns 1 for a repaired link, @dirty counts the rest */
+	size_type recover_link(node_ptr node, uint8_t lv, node_ptr next, size_type &dirty) {
+		node_pptr cur = node->load_next_pptr(lv);
+		node_pptr want = to_pptr(next);
+		if (cur == want)
+			return 0;
+		node->set_next_pptr(lv, want);
+		node->flush_next(get_objpool(), lv);
+		if (cur.getOffset() == want.getOffset() && !cur.isDelete()) {
+			dirty++;
+			return 0;
+		}
+		return 1;
+	}
+
+	/* a batch node and the search result it is linked at */
+	struct batch_slot {
+		node_ptr node;
+		node_array pre, succ;
+	};
+
+	/* a run of batch nodes falling into the same gap of one level */
+	struct batch_chain {
+		uint8_t level;
+		node_ptr pre, succ, head, tail;
+		size_t first, count;
+		bool linked;
+	};
+
+	struct runtime_type {
+		PMEMobjpool *pop;
+		uint64_t uuid;
+		/* slab lists: the free slots; outlives epoch, which frees into it */
+		slab_type slabs;
+		::fourpd::EpochManager epoch;
+		index_type index;
+		hash_type hash;
+		/* hashed lists: inserts between their level-0 link and their hash
+		 * entry, by key hash, see hash_lookup() */
+		struct alignas(64) pending_stripe {
+			std::atomic<uint32_t> count{0};
+		};
+		std::array<pending_stripe, kHashStripes> hash_pending;
+		/* indexable lists: writer serialization, and the ranks of pre[]
+		 * from the last find_position() of the lock holder */
+		std::mutex writer;
+		std::array<size_type, Height> ranks;
+		/* odd while a writer holds the lock, see read_spans() */
+		std::atomic<uint64_t> span_seq;
+		/* versioned lists: the last stamp handed out, the last one up to
+		 * which every write is done, the live snapshots, and the hidden
+		 * nodes by deletion stamp */
+		std::atomic<uint64_t> clock;
+		std::atomic<uint64_t> committed;
+		std::mutex versions;
+		std::multiset<uint64_t> snapshots;
+		std::multimap<uint64_t, node_ptr> hidden;
+		/* background expiry, see start_expiry() */
+		std::thread expiry;
+		std::mutex expiry_lock;
+		std::condition_variable expiry_cv;
+		bool expiry_stop;
+
+		runtime_type(self_type *list)
+			: pop(pmemobj_pool_by_oid(pmemobj_oid(list))),
+			  uuid(pmemobj_oid(list).pool_uuid_lo),
+			  epoch([list](std::vector<uint64_t> &batch) { list->free_nodes(batch); }),
+			  span_seq(0), clock(0), committed(0), expiry_stop(false)
+		{
+		}
+
+		/* the epoch slots and stripes are cache-line aligned, which a
+		 * plain new only honours from C++17 on */
+		static void *operator new(size_t size) {
+			void *mem;
+			if (posix_memalign(&mem, alignof(runtime_type), size) != 0)
+				throw std::bad_alloc();
+			return mem;
+		}
+
+		static void operator delete(void *mem) {
+			free(mem);
+		}
+	};
+
+	/* The original layout kept a std::mt19937_64 after _compare. The fields
+	 * up to _size live in its bytes, so that _size and the object size stay
+	 * where pools of that layout have them. */
+	static constexpr size_t kReserved = sizeof(std::mt19937_64) -
+		(sizeof(runtime_type *) + sizeof(slab_root) + 7) / 8 * 8;
+
 	atomic_node_pptr _head;
 	node_pptr _tail;
 	key_compare _compare;
-	std::mt19937_64 _random;
-	pmem::obj::p<size_type> _size;
+	runtime_type *_runtime;
+	slab_root _slabs;
+	char _reserved[kReserved];
+	std::atomic<size_type> _size;
 
 	/* helper func */
+
+	/* lists of this process with a runtime; _runtime itself may still hold
+	 * a pointer of the process that used the pool before */
+	static std::set<const void *> &live_runtimes() {
+		static std::set<const void *> lists;
+		return lists;
+	}
+
+	static std::mutex &runtime_lock() {
+		static std::mutex lock;
+		return lock;
+	}
+
+	void create_runtime() {
+		std::lock_guard<std::mutex> lock(runtime_lock());
+		if (live_runtimes().count(this))
+			throw std::logic_error("the runtime of this skiplist is already initialized");
+		_runtime = new runtime_type(this);
+		live_runtimes().insert(this);
+	}
+
+	/*
+	 * One write operation of the calling thread. Links it publishes by
+	 * link_next() and mark_next(), and flushes it announces by
+	 * flushed_later(), share a single drain when the outermost scope
+	 * closes; the links are settled after it. Outside of any scope, and
+	 * with strict_persist, every step is drained at once.
+	 */
+	class durable_scope {
+	public:
+		explicit durable_scope(self_type *list) : _list(list) {
+			pending().depth++;
+		}
+		~durable_scope() {
+			if (--pending().depth == 0)
+				_list->complete_operation();
+		}
+		durable_scope(const durable_scope &) = delete;
+		durable_scope &operator=(const durable_scope &) = delete;
+	private:
+		self_type *_list;
+	};
+
+	/* links of the current operation still carrying kDirtyFlag */
+	struct pending_links {
+		struct link {
+			node_ptr node;
+			uint8_t level;
+			node_pptr desired;
+		};
+		unsigned depth = 0;
+		size_t count = 0;
+		bool flushed = false;
+		std::array<link, 2 * Height> links;
+	};
+
+	static pending_links &pending() {
+		static thread_local pending_links p;
+		return p;
+	}
+
+	static bool deferred() {
+		return persist_type::per_operation && pending().depth > 0;
+	}
+
+	/* link_next_pptr() whose drain may wait for the end of the operation */
+	bool link_next(node_ptr node, uint8_t lv, node_pptr expected, node_pptr desired) {
+		if (!node->publish_next_pptr(get_objpool(), lv, expected, desired))
+			return false;
+		settle_later(node, lv, desired);
+		return true;
+	}
+
+	/* mark_next_pptr() whose drain may wait for the end of the operation */
+	bool mark_next(node_ptr node, uint8_t lv) {
+		if (!node->publish_mark(get_objpool(), lv))
+			return false;
+		settle_later(node, lv, node_pptr(node->load_next_pptr(lv).getOffset(), true, false));
+		return true;
+	}
+
+	void settle_later(node_ptr node, uint8_t lv, node_pptr desired) {
+		if (!persist_type::flushes)
+			return;
+		if (!deferred()) {
+			persist_type::drain(get_objpool());
+			node->settle_next_pptr(lv, desired);
+			return;
+		}
+		pending_links &p = pending();
+		if (p.count == p.links.size())
+			complete_operation();
+		p.links[p.count++] = {node, lv, desired};
+	}
+
+	/* the caller flushed something the operation depends on */
+	void flushed_later() {
+		if (!deferred())
+			persist_type::drain(get_objpool());
+		else
+			pending().flushed = true;
+	}
+
+	/* the drain of the current operation */
+	void complete_operation() {
+		pending_links &p = pending();
+		if (p.count == 0 && !p.flushed)
+			return;
+		persist_type::drain(get_objpool());
+		for (size_t i = 0; i < p.count; i++)
+			p.links[i].node->settle_next_pptr(p.links[i].level, p.links[i].desired);
+		p.count = 0;
+		p.flushed = false;
+	}
+
+	/* transaction::run() that counts aborts */
+	template <typename F>
+	static void run_transaction(pool_base pop, F &&f) {
+		try {
+			pmem::obj::transaction::run(pop, std::forward<F>(f));
+		} catch (...) {
+			stats_type::add(stat::tx_aborts);
+			stats_type::trace(trace_event::tx_abort);
+			throw;
+		}
+	}
+
 	template <typename... Args>
-	inline node_pptr allocate_node(Args &&... args) {
-		auto pptr = make_persistent<slnode_type>(std::forward<Args>(args)...);
-		LOG4P_DEBUG("vptr=%p, pmemobj_oid={%llu,%llu}", (void*)pptr.get(), pmemobj_oid(pptr.get()).pool_uuid_lo, pmemobj_oid(pptr.get()).off);
-		return node_pptr(pptr.raw().off);
+	inline node_pptr allocate_node(uint8_t height, Args &&... args) {
+		return allocate_node(true, height, std::forward<Args>(args)...);
+	}
+
+	/* allocate_node() for a node to be linked: unless its tower is
+	 * external, the transaction does not flush it, flush_node() does */
+	template <typename... Args>
+	inline node_pptr allocate_unflushed(uint8_t height, Args &&... args) {
+		return allocate_node(false, height, std::forward<Args>(args)...);
+	}
+
+	template <typename... Args>
+	inline node_pptr allocate_node(bool flush, uint8_t height, Args &&... args) {
+		if (Traits::slab_allocator) {
+			/* the slot is free: added to the transaction, never snapshotted */
+			void *slot = _runtime->slabs.take(height);
+			pmemobj_tx_xadd_range_direct(slot, _runtime->slabs.slot_size(height),
+				POBJ_XADD_NO_SNAPSHOT | (flush ? 0 : POBJ_XADD_NO_FLUSH));
+			new (slot) slnode_type(std::forward<Args>(args)..., height);
+			return to_pptr(static_cast<node_ptr>(slot));
+		}
+		if (!Traits::inline_tower) {
+			auto pptr = make_persistent<slnode_type>(std::forward<Args>(args)..., height);
+			return node_pptr(pptr.raw().off);
+		}
+		/* one allocation for the node and its tower */
+		PMEMoid oid = pmemobj_tx_xalloc(slnode_type::alloc_size(height),
+			pmem::detail::type_num<slnode_type>(), POBJ_XALLOC_NO_ABORT | (flush ? 0 : POBJ_XALLOC_NO_FLUSH));
+		if (OID_IS_NULL(oid))
+			throw pmem::transaction_alloc_error("failed to allocate persistent memory object");
+		new (pmemobj_direct(oid)) slnode_type(std::forward<Args>(args)..., height);
+		return node_pptr(oid.off);
 	}
 
 	inline void deallocate(node_pptr node) {
 		assert(node.getVptr(get_objpool()) != nullptr);
-		LOG4P_DEBUG("vptr=%p", node.getVptr(get_objpool()));
 		pool_base pop = get_pool_base();
-		pmem::obj::transaction::run(pop, [&] {
+		if (Traits::slab_allocator) {
+			node_ptr n = node.getVptr(get_objpool());
+			uint8_t height = n->height();
+			run_transaction(pop, [&] { n->~slnode_type(); });
+			_runtime->slabs.give(n, height);
+			return;
+		}
+		run_transaction(pop, [&] {
 			delete_persistent<slnode_type>(node.getPptr(get_pool_uuid()));
 			// node = nullptr;
 		});
 	}
 
+	/* frees a batch of retired nodes in a single transaction */
+	void free_nodes(std::vector<uint64_t> &batch) {
+		pool_base pop = get_pool_base();
+		uint64_t uuid = get_pool_uuid();
+		std::vector<std::pair<node_ptr, uint8_t>> slots;
+		run_transaction(pop, [&] {
+			for (auto offset : batch) {
+				if ((offset & kHashRetire) == kHashRetire) {
+					hash_type::destroy(reinterpret_cast<void *>(offset & ~kHashRetire));
+				} else if (offset & kVolatileRetire) {
+					index_type::destroy(reinterpret_cast<typename index_type::vnode *>(offset & ~kVolatileRetire));
+				} else if (offset & kValueRetire) {
+					destroy_value(reinterpret_cast<char *>(get_objpool()) + (offset & ~kValueRetire),
+						is_out_of_line<mapped_type>());
+				} else if (Traits::slab_allocator) {
+					node_ptr node = node_pptr(offset).getVptr(get_objpool());
+					slots.emplace_back(node, node->height());
+					node->~slnode_type();
+				} else {
+					delete_persistent<slnode_type>(node_pptr(offset).getPptr(uuid));
+				}
+			}
+		});
+		for (auto &slot : slots)
+			_runtime->slabs.give(slot.first, slot.second);
+	}
+
+	/* how update_node() replaces a value */
+	struct version_value {};
+	struct swap_value {};
+	struct store_value {};
+	using update_tag = typename std::conditional<Traits::versioned, version_value,
+		typename std::conditional<is_out_of_line<mapped_type>::value, swap_value, store_value>::type>::type;
+
+	static const T &plain_value(const out_of_line<T> &value) {
+		return value.get();
+	}
+
+	static const T &plain_value(const T &value) {
+		return value;
+	}
+
+	/* Finds @key and sets its value to @make(value). If @key is not present
+	 * @insert is inserted, unless it is nullptr; then the result is
+	 * (end(), false). The flag tells whether @key was found. */
+	template <typename K, typename M, typename Make>
+	std::pair<iterator, bool> internal_upsert(const K &key, const M *insert, Make &&make) {
+		static_assert(atomic_update, "values of more than a word are replaced only out_of_line "
+			"or in versioned lists, see out_of_line_values");
+		auto lock = write_lock();
+		durable_scope scope(this);
+		if (hashed && !Traits::versioned) {
+			/* an update needs no search position */
+			if (node_ptr node = hash_find(key)) {
+				update_node(node, make);
+				return std::pair<iterator, bool>(iterator(node, get_objpool(), epoch()), !insert);
+			}
+		}
+		node_array pre, succ;
+		while (true) {
+			if (find_position(key, pre, succ)) {
+				node_ptr node = update_node(succ[0], make);
+				if (node)
+					return std::pair<iterator, bool>(iterator(node, get_objpool(), epoch()), !insert);
+			} else if (!insert) {
+				return std::pair<iterator, bool>(end(), false);
+			} else {
+				std::pair<iterator, bool> res = internal_insert(pre, succ, key, *insert);
+				if (res.second)
+					return res;
+			}
+		}
+	}
+
+	/* Sets the value of the live @node to @make(value). Returns the node now
+	 * holding it, or nullptr if @node was erased or replaced meanwhile in a
+	 * versioned list. */
+	template <typename Make>
+	node_ptr update_node(node_ptr node, Make &make) {
+		return update_node(node, make, update_tag());
+	}
+
+	template <typename Make, typename Tag>
+	node_ptr update_node(node_ptr node, Make &make, Tag tag) {
+		update_value(node, make, tag);
+		return node;
+	}
+
+	template <typename Make>
+	node_ptr update_node(node_ptr node, Make &make, version_value) {
+		node_pptr newNode;
+		run_transaction(get_pool_base(), [&] {
+			newNode = allocate_unflushed(random_height(), node->getKey(), make(plain_value(node->getValue().second)));
+		});
+		return replace_version(node, newNode) ? newNode.getVptr(get_objpool()) : nullptr;
+	}
+
+	template <typename Make>
+	void update_value(node_ptr node, Make &make, store_value) {
+		using word = typename atomic_word<sizeof(mapped_type)>::type;
+		word *target = reinterpret_cast<word *>(&node->getValue().second);
+		word cur = __atomic_load_n(target, __ATOMIC_ACQUIRE);
+		while (true) {
+			typename std::aligned_storage<sizeof(mapped_type), alignof(mapped_type)>::type old;
+			std::memcpy(&old, &cur, sizeof(word));
+			mapped_type fresh(make(*reinterpret_cast<const mapped_type *>(&old)));
+			word want;
+			std::memcpy(&want, &fresh, sizeof(word));
+			if (__atomic_compare_exchange_n(target, &cur, want, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				break;
+			stats_type::add(stat::cas_retries);
+		}
+		slnode_type::flush(get_objpool(), target, sizeof(word));
+		flushed_later();
+	}
+
+	/* the replaced out_of_line value is retired, readers may still hold it */
+	template <typename Make>
+	void update_value(node_ptr node, Make &make, swap_value) {
+		mapped_type &value = node->getValue().second;
+		const T *old;
+		bool swapped = false;
+		while (true) {
+			old = &value.get();
+			run_transaction(get_pool_base(), [&] {
+				swapped = value.compare_exchange(old, make(*old));
+			});
+			if (swapped)
+				break;
+			stats_type::add(stat::cas_retries);
+		}
+		_runtime->epoch.retire(uint64_t(reinterpret_cast<const char *>(old) -
+			reinterpret_cast<char *>(get_objpool())) | kValueRetire);
+	}
+
+	void destroy_value(void *value, std::true_type) {
+		mapped_type::destroy(static_cast<typename mapped_type::value_type *>(value));
+	}
+
+	void destroy_value(void *value, std::false_type) {}
+
+	void attach_slabs() {
+		_runtime->slabs.attach(_runtime->pop, reinterpret_cast<typename slab_type::root *>(&_slabs),
+			[](size_t c) { return slnode_type::alloc_size(uint8_t(c)); });
+	}
+
+	/* slab lists: every slot not holding a node linked on some pmem level
+	 * is free. Erased nodes can still be linked above level 0. */
+	void rebuild_slabs() {
+		PMEMobjpool *pop = get_objpool();
+		attach_slabs();
+		_runtime->slabs.begin_rebuild();
+		_runtime->slabs.mark_used(_tail.getVptr(pop));
+		for (int lv = top_level; lv >= 0; lv--) {
+			for (node_ptr node = head_node(); !node->isTail(); node = node->load_next_ptr(pop, lv))
+				_runtime->slabs.mark_used(node);
+		}
+		size_t free = _runtime->slabs.end_rebuild();
+		LOG4P_DEBUG("%zu free slab slots", free);
+		(void)free;
+	}
+
+	/* collect level 0 in one pass, then link the DRAM towers of hybrid
+	 * mode and fill the hash index */
+	void rebuild_index() {
+		PMEMobjpool *pop = get_objpool();
+		std::vector<typename index_type::entry> entries;
+		std::vector<std::pair<uint64_t, node_ptr>> hashes;
+		for (node_ptr node = next_node(_head.load().getVptr(pop)); !node->isTail(); node = next_node(node)) {
+			if (Traits::hybrid_index && node->height() > 1)
+				entries.push_back({node, node->key_prefix(), uint8_t(node->height() - 1)});
+			if (hashed)
+				hashes.emplace_back(key_hash(node->getKey()), node);
+		}
+		if (Traits::hybrid_index)
+			_runtime->index.build(entries, std::thread::hardware_concurrency());
+		if (hashed)
+			_runtime->hash.build(hashes);
+		LOG4P_DEBUG("rebuilt volatile index with %zu entries, hash with %zu", entries.size(), hashes.size());
+	}
+
+	/* Where a search for @key starts on level top_level: _head, or in hybrid
+	 * mode the closest node below @key found in the DRAM index. */
+	template <typename K>
+	node_ptr start_node(PMEMobjpool *pop, const K &key, uint64_t prefix) {
+		return start_node_by(pop, [&](node_ptr n, uint64_t p) {
+			return key_cmp(n, p, key, prefix);
+		});
+	}
+
+	/* start_node() for a position given by @cmp, see volatile_index::floor() */
+	template <typename Cmp>
+	node_ptr start_node_by(PMEMobjpool *pop, Cmp &&cmp) {
+		node_ptr head = head_node();
+		if (!Traits::hybrid_index)
+			return head;
+		/* an entry may briefly outlive its erased node, see internal_insert() */
+		for (int attempt = 0; attempt < 16; attempt++) {
+			node_ptr node = _runtime->index.floor(cmp);
+			if (!node)
+				return head;
+			if (visible(node))
+				return node;
+			std::this_thread::yield();
+		}
+		return head;
+	}
+
+	void index_insert(node_ptr node) {
+		const key_type &key = node->getKey();
+		uint64_t prefix = node->key_prefix();
+		_runtime->index.insert(node, prefix, node->height() - 1, [&](node_ptr n, uint64_t p) {
+			return key_cmp(n, p, key, prefix);
+		});
+	}
+
+	void index_remove(node_ptr node) {
+		const key_type &key = node->getKey();
+		uint64_t prefix = node->key_prefix();
+		auto vnode = _runtime->index.remove(node, [&](node_ptr n, uint64_t p) {
+			return key_cmp(n, p, key, prefix);
+		});
+		if (vnode)
+			_runtime->epoch.retire(reinterpret_cast<uint64_t>(vnode) | kVolatileRetire);
+	}
+
+	template <typename K>
+	static uint64_t key_hash(const K &key) {
+		return typename Traits::key_hash()(key);
+	}
+
+	/* the visible node of @key found through the hash index */
+	template <typename K>
+	node_ptr hash_find(const K &key) {
+		return _runtime->hash.find(key_hash(key), [&](node_ptr n) {
+			return !_compare(n->getKey(), key) && !_compare(key, n->getKey()) && visible(n);
+		});
+	}
+
+	/* Linearizable find() through the hash index: a miss falls back to the
+	 * ordered search while an insert of a key with the same stripe may be
+	 * live on level 0 without its entry yet. The stripe is read first; an
+	 * insert it missed was not live when the lookup began. */
+	template <typename K>
+	node_ptr hash_lookup(const K &key) {
+		uint64_t hash = key_hash(key);
+		auto &pending = _runtime->hash_pending[hash % kHashStripes].count;
+		bool settled = pending.load(std::memory_order_seq_cst) == 0;
+		node_ptr node = hash_find(key);
+		if (node || settled)
+			return node;
+		std::pair<node_ptr, bool> res = find_less_or_equal(key);
+		return res.second ? res.first : nullptr;
+	}
+
+	/* brackets an insert of @node from before its level-0 link until its
+	 * hash entry exists, see hash_lookup() */
+	void hash_announce(node_ptr node) {
+		if (hashed)
+			_runtime->hash_pending[key_hash(node->getKey()) % kHashStripes].count
+				.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+	void hash_settle(node_ptr node) {
+		if (hashed)
+			_runtime->hash_pending[key_hash(node->getKey()) % kHashStripes].count
+				.fetch_sub(1, std::memory_order_release);
+	}
+
+	void hash_insert(node_ptr node) {
+		std::vector<void *> retired;
+		_runtime->hash.insert(key_hash(node->getKey()), node, retired);
+		for (void *block : retired)
+			_runtime->epoch.retire(reinterpret_cast<uint64_t>(block) | kHashRetire);
+		/* an erase that ran before the entry existed could not remove it */
+		if (!visible(node))
+			hash_remove(node);
+	}
+
+	void hash_remove(node_ptr node) {
+		auto entry = _runtime->hash.remove(key_hash(node->getKey()), node);
+		if (entry)
+			_runtime->epoch.retire(reinterpret_cast<uint64_t>(entry) | kHashRetire);
+	}
+
+	::fourpd::EpochManager *epoch() const {
+		return &_runtime->epoch;
+	}
+
+	/* write_lock() of an indexable list: the writer mutex, with span_seq
+	 * odd while it is held */
+	class writer_lock {
+	public:
+		writer_lock() : _runtime(nullptr) {}
+		explicit writer_lock(runtime_type *runtime) : _runtime(runtime) {
+			_runtime->writer.lock();
+			_runtime->span_seq.fetch_add(1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+		}
+		writer_lock(writer_lock &&other) : _runtime(other._runtime) {
+			other._runtime = nullptr;
+		}
+		writer_lock(const writer_lock &) = delete;
+		writer_lock &operator=(const writer_lock &) = delete;
+		~writer_lock() {
+			if (!_runtime)
+				return;
+			_runtime->span_seq.fetch_add(1, std::memory_order_release);
+			_runtime->writer.unlock();
+		}
+	private:
+		runtime_type *_runtime;
+	};
+
+	/* taken by every writer of an indexable list, so that spans stay exact */
+	writer_lock write_lock() {
+		if (!Traits::indexable)
+			return writer_lock();
+		return writer_lock(_runtime);
+	}
+
+	/* Runs the span walk @f of an indexable list until no writer held the
+	 * lock meanwhile, so that readers never wait for writers. */
+	template <typename F>
+	auto read_spans(F &&f) const -> decltype(f()) {
+		auto &seq = _runtime->span_seq;
+		while (true) {
+			uint64_t before = seq.load(std::memory_order_acquire);
+			if (before & 1) {
+				std::this_thread::yield();
+				continue;
+			}
+			auto result = f();
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq.load(std::memory_order_relaxed) == before)
+				return result;
+		}
+	}
+
+	/* operator[] of an indexable list */
+	node_ptr position_node(size_type pos, std::true_type) const {
+		node_ptr node = read_spans([&] { return select_node(pos); });
+		assert(node);
+		return node;
+	}
+
+	node_ptr position_node(size_type pos, std::false_type) const {
+		PMEMobjpool *pop = get_objpool();
+		node_ptr node = _head.load(std::memory_order_relaxed).getVptr(pop)->next_visible(pop);
+		for (; pos > 0 && !node->isTail(); pos--)
+			node = node->next_visible(pop);
+		assert(!node->isTail());
+		return node;
+	}
+
+	/* indexable lists: recompute the spans from the links, one pass over the
+	 * list. Assumes every node is linked on all of its levels. */
+	void rebuild_spans() {
+		PMEMobjpool *pop = get_objpool();
+		node_array last;
+		last.fill(_head.load().getVptr(pop));
+		std::array<size_type, Height> last_rank{};
+		size_type rank = 0;
+		for (node_ptr node = last[0]->load_next_ptr(pop, 0); !node->isTail(); node = node->load_next_ptr(pop, 0)) {
+			rank++;
+			for (uint8_t lv = 0; lv < node->levels(); lv++) {
+				last[lv]->set_span(lv, rank - last_rank[lv]);
+				last[lv] = node;
+				last_rank[lv] = rank;
+			}
+		}
+		for (uint8_t lv = 0; lv < Height; lv++)
+			last[lv]->set_span(lv, rank + 1 - last_rank[lv]);
+	}
+
+	/* node at position @pos, found through the spans; nullptr if they do
+	 * not add up, as they may while a writer holds the lock */
+	node_ptr select_node(size_type pos) const {
+		PMEMobjpool *pop = get_objpool();
+		node_ptr node = _head.load(std::memory_order_relaxed).getVptr(pop);
+		size_type rank = 0;
+		for (int level = Height - 1; level >= 0; level--) {
+			node_ptr next = node->load_next_ptr(pop, level);
+			while (!next->isTail() && rank + node->span(level) <= pos + 1) {
+				rank += node->span(level);
+				node = next;
+				next = node->load_next_ptr(pop, level);
+			}
+		}
+		return rank == pos + 1 ? node : nullptr;
+	}
+
+	/* indexable: account for @node, just linked on level 0 behind pre[0] */
+	void insert_spans(node_ptr node, node_array &pre) {
+		auto &rank = _runtime->ranks;
+		for (uint8_t i = 0; i < Height; i++) {
+			if (i < node->levels()) {
+				node->set_span(i, pre[i]->span(i) - (rank[0] - rank[i]));
+				pre[i]->set_span(i, rank[0] - rank[i] + 1);
+			} else {
+				pre[i]->set_span(i, pre[i]->span(i) + 1);
+			}
+		}
+	}
+
+	/* indexable: account for @node, about to be unlinked from behind pre[] */
+	void erase_spans(node_ptr node, node_array &pre, node_array &succ) {
+		for (uint8_t i = 0; i < Height; i++) {
+			if (succ[i] == node)
+				pre[i]->set_span(i, pre[i]->span(i) + node->span(i) - 1);
+			else
+				pre[i]->set_span(i, pre[i]->span(i) - 1);
+		}
+	}
+
 	inline uint8_t random_height() {
+		static thread_local std::mt19937_64 random(
+			(unsigned long)std::chrono::system_clock::now().time_since_epoch().count() ^
+			std::hash<std::thread::id>()(std::this_thread::get_id()));
 		uint8_t height = 1;
 		std::uniform_int_distribution<uint8_t> dist(0, Branch-1);
-        while (height < Height && dist(_random) == 0) {
+        while (height < Height && dist(random) == 0) {
             height ++;
         }
         return height;
 	}
 
+	/* Locate the predecessors and successors of @key on every level. Links of
+	 * logically deleted nodes (kDeleteFlag) met on the way are unlinked; if such
+	 * an unlink loses a race the search restarts from the top. */
 	template <typename K>
-	std::pair<node_ptr, bool> find_less_or_equal(const K &key, std::vector<node_ptr> &pre) 
+	bool find_position(const K &key, node_array &pre, node_array &succ)
 	{
-		node_ptr head = _head.load().getVptr(get_objpool());
-		node_ptr node = head;
-		LOG4P_DEBUG("head = %p", (void*)head);
-		uint8_t level = Height - 1;
-		while (true) {
-			node_ptr next = node->get_next_ptr(level);
-			LOG4P_DEBUG("head->next[%u]=%p", unsigned(level), (void*)next);
-			if (is_after_node(key, next)) {
-				LOG4P_DEBUG("is_after_node returns TRUE");
-				node = next;
-			} else {
-				LOG4P_DEBUG("is_after_node returns FALSE");
-				pre[level] = node;
-				if (level == 0) {
-					if (next->isTail()) {
-						LOG4P_DEBUG("next->isTail=TURE, key=%s", key.data());
-						return ((node != head) && (!_compare(key, node->getKey()) && !_compare(node->getKey(), key))) ?
-							std::pair<node_ptr, bool>(node, true) :
-							std::pair<node_ptr, bool>(node, false);
-					}
-					else if (!_compare(key, next->getKey()) && !_compare(next->getKey(), key)) {
-						LOG4P_DEBUG("next is the target, key=%s, next=%p->key=", key.data(), (void*)next, next->getKey().data());
-						return std::pair<node_ptr, bool>(next, true);
-					} else {
-						LOG4P_DEBUG("next is NOT the target, key=%s, node=%p", key.data(), (void*)node);
-						return ((node != head) && (!_compare(key, node->getKey()) && !_compare(node->getKey(), key))) ?
-							std::pair<node_ptr, bool>(node, true) :
-							std::pair<node_ptr, bool>(node, false);
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(key);
+		auto before = [&](node_ptr n) { return node_less(n, key, prefix); };
+		while (!descend(pop, before, start_node(pop, key, prefix), top_level, 0, pre, succ))
+			;
+		return !succ[0]->isTail() && !key_less(key, prefix, succ[0]) && !succ[0]->hidden();
+	}
+
+	/* find_position() around @node itself. In a versioned list it may lie
+	 * behind newer versions of its key, which sort first. */
+	void find_node_position(node_ptr node, node_array &pre, node_array &succ)
+	{
+		if (!Traits::versioned) {
+			find_position(node->getKey(), pre, succ);
+			return;
+		}
+		PMEMobjpool *pop = get_objpool();
+		const key_type &key = node->getKey();
+		uint64_t prefix = node->key_prefix();
+		auto before = [&](node_ptr n) {
+			return node_less(n, key, prefix) ||
+				(n != node && !key_less(key, prefix, n) && n->created() > node->created());
+		};
+		while (!descend(pop, before, start_node(pop, key, prefix), top_level, 0, pre, succ))
+			;
+	}
+
+	/* Finger search: @pre and @succ hold the result for a smaller key, so
+	 * only the levels whose successor @key has moved past are walked again,
+	 * starting from the old predecessor. */
+	template <typename K>
+	bool find_position_after(const K &key, node_array &pre, node_array &succ)
+	{
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(key);
+		auto before = [&](node_ptr n) { return node_less(n, key, prefix); };
+		int level = 0;
+		while (level <= top_level && !succ[level]->isTail() && before(succ[level]))
+			level++;
+		if (level > top_level || pre[level]->load_next_pptr(level).isDelete() ||
+		    !descend(pop, before, pre[level], level, Traits::indexable ? _runtime->ranks[level] : 0, pre, succ))
+			return find_position(key, pre, succ);
+		return !succ[0]->isTail() && !key_less(key, prefix, succ[0]) && !succ[0]->hidden();
+	}
+
+	/* one pass of find_position() from @node (at position @rank, indexable
+	 * lists only) on @level down, stopping at the first node not @before
+	 * the searched position; false if it has to be restarted */
+	template <typename Before>
+	bool descend(PMEMobjpool *pop, Before &before, node_ptr node, int level,
+		     size_type rank, node_array &pre, node_array &succ)
+	{
+		count_search(level + 1);
+		for (; level >= 0; level--) {
+			/* the link of @node as we left it: unlinks stay dirty until
+			 * the operation drains */
+			count_link(node, level);
+			node_pptr link = node->get_next_pptr(pop, level);
+			/* @node is being erased: unlinking behind it would drop its mark */
+			if (link.isDelete())
+				return false;
+			node_ptr next = link.getVptr(pop);
+			while (!next->isTail()) {
+				count_link(next, level);
+				node_pptr after = next->get_next_pptr(pop, level);
+				if (after.isDelete()) {
+					if (!link_next(node, level, link, node_pptr(after.getOffset(), false, false))) {
+						count_cas_retry(level);
+						return false;
 					}
+					link = node_pptr(after.getOffset(), false, persist_type::flushes && deferred());
+					next = after.getVptr(pop);
+					continue;
 				}
-				level--;
+				if (!before(next))
+					break;
+				if (Traits::indexable)
+					rank += node->span(level);
+				node = next;
+				link = after;
+				next = after.getVptr(pop);
 			}
+			pre[level] = node;
+			succ[level] = next;
+			if (Traits::indexable)
+				_runtime->ranks[level] = rank;
+		}
+		return true;
+	}
+
+	/* Load for point reads. It never writes, but a dirty level-0 link the
+	 * result depends on is flushed so that the reader does not return a
+	 * state a crash could still undo. */
+	node_pptr read_next(PMEMobjpool *pop, node_ptr node, int level) {
+		count_link(node, level);
+		node_pptr link = node->load_next_pptr(level);
+		if (level == 0 && link.isDirty()) {
+			stats_type::add(stat::dirty_helps);
+			stats_type::trace(trace_event::dirty_help, 0);
+			node->persist_next(pop, 0);
 		}
+		return link;
+	}
+
+	/* Read-only search: returns the node holding @key, or its level-0
+	 * predecessor. Deleted nodes are skipped rather than unlinked. */
+	template <typename K>
+	std::pair<node_ptr, bool> find_less_or_equal(const K &key)
+	{
+		PMEMobjpool *pop = get_objpool();
+		uint64_t prefix = prefix_type::of(key);
+		node_ptr node = start_node(pop, key, prefix);
+		node_ptr next = nullptr;
+		count_search(top_level + 1);
+		for (int level = top_level; level >= 0; level--) {
+			next = read_next(pop, node, level).getVptr(pop);
+			while (!next->isTail()) {
+				node_pptr after = read_next(pop, next, level);
+				if (after.isDelete()) {
+					next = after.getVptr(pop);
+					continue;
+				}
+				if (!node_less(next, key, prefix))
+					break;
+				node = next;
+				next = after.getVptr(pop);
+			}
+		}
+		return (!next->isTail() && !key_less(key, prefix, next) && !next->hidden()) ?
+			std::pair<node_ptr, bool>(next, true) :
+			std::pair<node_ptr, bool>(node, false);
+	}
+
+	node_ptr head_node() {
+		return _head.load(std::memory_order_acquire).getVptr(get_objpool());
+	}
+
+	/* Read-only search for the predecessors of @stop, which may be the
+	 * tail, on every level. Deleted and hidden nodes are skipped. */
+	void find_before(node_ptr stop, node_array &pre) {
+		PMEMobjpool *pop = get_objpool();
+		bool tail = stop->isTail();
+		uint64_t prefix = tail ? 0 : stop->key_prefix();
+		node_ptr node = tail ?
+			start_node_by(pop, [](node_ptr, uint64_t) { return -1; }) :
+			start_node(pop, stop->getKey(), prefix);
+		for (int level = top_level; level >= 0; level--) {
+			node_ptr next = node->load_next_ptr(pop, level);
+			while (!next->isTail()) {
+				node_pptr after = next->load_next_pptr(level);
+				if (after.isDelete() || next->hidden()) {
+					next = after.getVptr(pop);
+					continue;
+				}
+				if (!tail && !node_less(next, stop->getKey(), prefix))
+					break;
+				node = next;
+				next = after.getVptr(pop);
+			}
+			pre[level] = node;
+		}
+	}
+
+	/* Appends the live nodes from the predecessor of @stop on @level (at
+	 * most top_level) up to @stop, in ascending order, to @out. Returns true
+	 * if that predecessor is _head, i.e. nothing lies before the run. */
+	bool collect_before(node_ptr stop, std::vector<node_ptr> &out, int level) {
+		node_array pre;
+		find_before(stop, pre);
+		/* a copy: std::min() would odr-use top_level */
+		const int top = top_level;
+		node_ptr node = pre[std::min(level, top)];
+		bool bottom = node == head_node();
+		if (!bottom)
+			out.push_back(node);
+		uint64_t prefix = stop->isTail() ? 0 : stop->key_prefix();
+		for (node = next_node(node); !node->isTail(); node = next_node(node)) {
+			if (!stop->isTail() && !node_less(node, stop->getKey(), prefix))
+				break;
+			out.push_back(node);
+		}
+		return bottom;
+	}
+
+	/* neither erased nor hidden from the current view */
+	bool visible(node_ptr node) {
+		return !node->load_next_pptr(0).isDelete() && !node->hidden();
+	}
+
+	/* first visible successor of @node on level 0 */
+	node_ptr next_node(node_ptr node) {
+		PMEMobjpool *pop = get_objpool();
+		node_ptr next = node->load_next_ptr(pop, 0);
+		while (!next->isTail() && !visible(next))
+			next = next->load_next_ptr(pop, 0);
+		return next;
 	}
 
 	template <typename K, typename M>
-	std::pair<iterator, bool> internal_insert(std::vector<node_ptr> &pre, K &&key, M &&obj) {
-		auto pop = get_pool_base();
+	std::pair<iterator, bool> internal_insert(node_array &pre, node_array &succ, K &&key, M &&obj) {
+		PMEMobjpool *pop = get_objpool();
+		pool_base pb = get_pool_base();
 
 		node_pptr newNode;
 		uint8_t height = random_height();
-		LOG4P_DEBUG("random_height=%u", unsigned(height));
-		pmem::obj::transaction::run(pop, [&] {
-			newNode = allocate_node(std::forward<K>(key), std::forward<M>(obj), height);
+		stats_type::trace(trace_event::insert, height);
+		run_transaction(pb, [&] {
+			newNode = allocate_unflushed(height, std::forward<K>(key), std::forward<M>(obj));
 		});
-		for (uint64_t i = 0; i < height; i++) {
-			LOG4P_DEBUG("pre[%llu]=%p, ->next_pptr=%x", i, pre[i], pre[i]->get_next_pptr(i).getOffset());
-			newNode.getVptr(get_objpool())->set_next_pptr(i, pre[i]->get_next_pptr(i));
-			LOG4P_DEBUG("set newNode->next_pptr[%llu]=%x", i, newNode.getVptr(get_objpool())->get_next_pptr(i).getOffset());
-			pre[i]->set_next_pptr(i, newNode);
-			LOG4P_DEBUG("pre[%llu]=%p, ->next_pptr=%x", i, pre[i], pre[i]->get_next_pptr(i).getOffset());
-		}
-		_size++;
-		return std::pair<iterator, bool>(iterator(newNode.getVptr(get_objpool())), true);
-	}
-
-	size_type internal_erase(std::vector<node_ptr> &pre, node_ptr node) {
-		auto pop = get_pool_base();
-		auto target = pre[0]->get_next_pptr(0);
-		LOG4P_DEBUG("target= pre[0]=%p, ->next_pptr[0]=%x", pre[0], target.getOffset());
-		for (int i = node->height()-1; i >= 0; i--) {
-			LOG4P_DEBUG("pre[%llu]=%p, ->next_pptr=%p", i, pre[unsigned(i)], pre[unsigned(i)]->get_next_pptr(i).getOffset());
-			pre[unsigned(i)]->set_next_pptr(i, node->get_next_pptr(i));
-			LOG4P_DEBUG("set pre[%llu]=%p, ->next_pptr=%x", i, pre[unsigned(i)], node->get_next_pptr(i).getOffset());
-		}
-		deallocate(target);
-		_size--;
+		node_ptr node = link_node(newNode, pre, succ);
+		return std::pair<iterator, bool>(iterator(node, pop, epoch()), node == newNode.getVptr(pop));
+	}
+
+	/* Publishes the unreachable @newNode between @pre and @succ. Returns it,
+	 * or the node that won a race for the same key; @newNode is freed then. */
+	node_ptr link_node(node_pptr newNode, node_array &pre, node_array &succ) {
+		PMEMobjpool *pop = get_objpool();
+		node_ptr node = newNode.getVptr(pop);
+		hash_announce(node);
+		node->begin_linking();
+
+		/* level 0 is the linearization point */
+		while (true) {
+			/* versioned: stamped after the search, so that the node is newer
+			 * than any deletion the search saw */
+			version_stamp stamp(this);
+			node->set_created(stamp.ts());
+			for (uint8_t i = 0; i < node->levels(); i++)
+				node->set_next_pptr(i, to_pptr(succ[i]));
+			node->flush_node(pop);
+			flushed_later();
+			bool linked = link_next(pre[0], 0, to_pptr(succ[0]), newNode);
+			stamp.commit();
+			if (linked)
+				break;
+			count_cas_retry(0);
+			if (find_position(node->getKey(), pre, succ)) {
+				hash_settle(node);
+				deallocate(newNode);
+				return succ[0];
+			}
+		}
+		if (Traits::indexable)
+			insert_spans(node, pre);
+		_size.fetch_add(1, std::memory_order_relaxed);
+		link_tower(node, pre, succ);
+		return node;
+	}
+
+	/* links the upper levels of a node that is already live on level 0 */
+	void link_tower(node_ptr node, node_array &pre, node_array &succ) {
+		for (uint8_t i = 1; i < node->levels(); i++) {
+			if (!link_level(node, i, pre, succ))
+				break;
+		}
+		if (!node->load_next_pptr(0).isDelete())
+			index_node(node);
+		finish_tower(node, pre, succ);
+	}
+
+	/* Ends the insert of @node once its tower is linked. Links made after
+	 * an erase marked the node are unlinked again; if the eraser finished
+	 * first, it left retiring the node to us. */
+	void finish_tower(node_ptr node, node_array &pre, node_array &succ) {
+		hash_settle(node);
+		if (node->load_next_pptr(0).isDelete())
+			find_node_position(node, pre, succ);
+		if (!node->end_linking())
+			_runtime->epoch.retire(to_pptr(node).getOffset());
+	}
+
+	/* retires the erased and unlinked @node, unless its inserter is still
+	 * linking the tower, which might link it again */
+	void retire_node(node_ptr node) {
+		if (!node->hand_over())
+			_runtime->epoch.retire(to_pptr(node).getOffset());
+	}
+
+	/* enters a node that went live on level 0 into the DRAM indexes */
+	void index_node(node_ptr node) {
+		if (hashed)
+			hash_insert(node);
+		index_tower(node);
+	}
+
+	/* hybrid mode: enter the upper levels of a live node into the DRAM index */
+	void index_tower(node_ptr node) {
+		if (!Traits::hybrid_index || node->height() <= 1)
+			return;
+		index_insert(node);
+		/* an erase that ran before the entry existed could not remove it */
+		if (!visible(node))
+			index_remove(node);
+	}
+
+	/* Links @node on level @lv; false if it was erased meanwhile. The
+	 * links made so far are left to finish_tower(). */
+	bool link_level(node_ptr node, uint8_t lv, node_array &pre, node_array &succ) {
+		PMEMobjpool *pop = get_objpool();
+		while (true) {
+			node_pptr next = node->get_next_pptr(pop, lv);
+			if (next.isDelete())
+				break;
+			if (next.getOffset() != to_pptr(succ[lv]).getOffset()) {
+				if (!node->cas_next_pptr(lv, next, to_pptr(succ[lv]))) {
+					count_cas_retry(lv);
+					continue;
+				}
+				node->flush_next(pop, lv);
+				flushed_later();
+			}
+			if (link_next(pre[lv], lv, to_pptr(succ[lv]), to_pptr(node)))
+				break;
+			count_cas_retry(lv);
+			find_node_position(node, pre, succ);
+		}
+		/* erased while we were still building the tower */
+		return !node->load_next_pptr(0).isDelete();
+	}
+
+	template <typename U>
+	static U &&batch_arg(U &v, std::true_type) {
+		return std::move(v);
+	}
+
+	template <typename U>
+	static const U &batch_arg(U &v, std::false_type) {
+		return v;
+	}
+
+	template <typename ForwardIt, typename Move>
+	size_type internal_insert_batch(ForwardIt first, ForwardIt last, Move move) {
+		using item_ptr = decltype(&*first);
+		std::vector<item_ptr> items;
+		for (; first != last; ++first)
+			items.push_back(&*first);
+		std::stable_sort(items.begin(), items.end(), [&](item_ptr a, item_ptr b) {
+			return _compare(a->first, b->first);
+		});
+		items.erase(std::unique(items.begin(), items.end(), [&](item_ptr a, item_ptr b) {
+			return !_compare(a->first, b->first);
+		}), items.end());
+
+		epoch_guard guard(epoch());
+		auto lock = write_lock();
+		durable_scope scope(this);
+		PMEMobjpool *pop = get_objpool();
+		pool_base pb = get_pool_base();
+		size_type inserted = 0;
+		node_array pre, succ;
+		if (Traits::indexable || Traits::versioned) {
+			/* chains would need their spans patched or their own stamps;
+			 * link key by key */
+			for (item_ptr item : items) {
+				if (!find_position(item->first, pre, succ) &&
+				    internal_insert(pre, succ, batch_arg(item->first, move), batch_arg(item->second, move)).second)
+					inserted++;
+			}
+			return inserted;
+		}
+		std::vector<item_ptr> todo;
+		std::vector<batch_slot> slots;
+		for (size_t i = 0; i < items.size(); i += kBatchChunk) {
+			todo.clear();
+			slots.clear();
+			for (size_t j = i; j < std::min(items.size(), i + kBatchChunk); j++) {
+				const key_type &key = items[j]->first;
+				/* the previous chunk's nodes invalidate the finger */
+				if (j == i ? find_position(key, pre, succ) : find_position_after(key, pre, succ))
+					continue;
+				todo.push_back(items[j]);
+				slots.push_back({nullptr, pre, succ});
+			}
+			if (todo.empty())
+				continue;
+			run_transaction(pb, [&] {
+				for (size_t j = 0; j < todo.size(); j++)
+					slots[j].node = allocate_unflushed(random_height(),
+						batch_arg(todo[j]->first, move), batch_arg(todo[j]->second, move)).getVptr(pop);
+			});
+			inserted += link_batch(slots);
+		}
+		LOG4P_DEBUG("batch of %zu keys, %zu inserted", items.size(), inserted);
+		return inserted;
+	}
+
+	/* Links a chunk of sorted, allocated nodes. Nodes sharing a gap on a
+	 * level are chained privately and every chain is published with a single
+	 * CAS; the towers, the level-0 chains and the upper chains each share one
+	 * drain. Chains losing a race fall back to per-node linking. */
+	size_type link_batch(std::vector<batch_slot> &slots) {
+		PMEMobjpool *pop = get_objpool();
+		std::vector<batch_chain> chains;
+		std::array<size_t, Height> open;
+		open.fill(SIZE_MAX);
+		for (size_t j = 0; j < slots.size(); j++) {
+			node_ptr node = slots[j].node;
+			for (uint8_t lv = 0; lv < node->levels(); lv++) {
+				node_ptr pre = slots[j].pre[lv], succ = slots[j].succ[lv];
+				size_t c = open[lv];
+				if (c != SIZE_MAX && chains[c].pre == pre && chains[c].succ == succ) {
+					chains[c].tail->set_next_pptr(lv, to_pptr(node));
+					chains[c].tail = node;
+					chains[c].count++;
+				} else {
+					open[lv] = chains.size();
+					chains.push_back({lv, pre, succ, node, node, j, 1, false});
+				}
+				node->set_next_pptr(lv, to_pptr(succ));
+			}
+			node->flush_node(pop);
+			hash_announce(node);
+			node->begin_linking();
+		}
+		persist_type::drain(pop);
+
+		size_type inserted = publish_chains(chains, false);
+		_size.fetch_add(inserted, std::memory_order_relaxed);
+		bool degraded = false;
+		for (auto &c : chains) {
+			if (c.level != 0 || c.linked)
+				continue;
+			degraded = true;
+			for (size_t j = c.first; j < c.first + c.count; j++) {
+				batch_slot &slot = slots[j];
+				node_pptr pptr = to_pptr(slot.node);
+				/* link_node() announces it again */
+				hash_settle(slot.node);
+				if (find_position(slot.node->getKey(), slot.pre, slot.succ))
+					deallocate(pptr);
+				else if (link_node(pptr, slot.pre, slot.succ) == slot.node)
+					inserted++;
+				slot.node = nullptr;
+			}
+		}
+		if (degraded) {
+			LOG4P_DEBUG("level 0 chain lost a race, linking towers one by one");
+			for (auto &slot : slots) {
+				if (!slot.node)
+					continue;
+				find_position(slot.node->getKey(), slot.pre, slot.succ);
+				link_tower(slot.node, slot.pre, slot.succ);
+			}
+			return inserted;
+		}
+
+		publish_chains(chains, true);
+		for (auto &c : chains) {
+			if (c.level == 0 || c.linked)
+				continue;
+			for (size_t j = c.first, n = 0; n < c.count; j++) {
+				batch_slot &slot = slots[j];
+				if (slot.node->levels() <= c.level)
+					continue;
+				n++;
+				find_position(slot.node->getKey(), slot.pre, slot.succ);
+				link_level(slot.node, c.level, slot.pre, slot.succ);
+			}
+		}
+		for (auto &slot : slots) {
+			if (!slot.node->load_next_pptr(0).isDelete())
+				index_node(slot.node);
+			finish_tower(slot.node, slot.pre, slot.succ);
+		}
+		return inserted;
+	}
+
+	/* publishes the level-0 chains, or those of the upper levels, sharing
+	 * one drain; returns the number of nodes made reachable */
+	size_type publish_chains(std::vector<batch_chain> &chains, bool upper) {
+		PMEMobjpool *pop = get_objpool();
+		size_type linked = 0;
+		bool published = false;
+		for (auto &c : chains) {
+			if ((c.level > 0) != upper)
+				continue;
+			c.linked = c.pre->publish_next_pptr(pop, c.level, to_pptr(c.succ), to_pptr(c.head));
+			published |= c.linked;
+		}
+		if (!published)
+			return 0;
+		persist_type::drain(pop);
+		for (auto &c : chains) {
+			if ((c.level > 0) != upper || !c.linked)
+				continue;
+			c.pre->settle_next_pptr(c.level, to_pptr(c.head));
+			linked += c.count;
+		}
+		return linked;
+	}
+
+	size_type internal_erase(node_array &pre, node_array &succ, node_ptr node) {
+		if (Traits::versioned)
+			return hide_node(node);
+		if (!unlink_node(node, pre, succ))
+			return 0;
+		_size.fetch_sub(1, std::memory_order_relaxed);
 		return 1;
 	}
 
-	PMEMobjpool *get_objpool() {
-		PMEMoid oid = pmemobj_oid(this);
-		return pmemobj_pool_by_oid(oid);
+	/* Marks @node on every level, unlinks and retires it; false if another
+	 * thread got to mark level 0 first. */
+	bool unlink_node(node_ptr node, node_array &pre, node_array &succ) {
+		for (int i = node->levels()-1; i >= 1; i--)
+			mark_next(node, i);
+		/* drop the DRAM entry first so that searches stop starting from the node */
+		if (Traits::hybrid_index && node->height() > 1)
+			index_remove(node);
+		/* false if another thread erased it first */
+		bool marked = mark_next(node, 0);
+		/* one drain for the marks, before the search below would help
+		 * persist them one by one */
+		complete_operation();
+		if (!marked)
+			return false;
+		stats_type::trace(trace_event::erase);
+		if (hashed)
+			hash_remove(node);
+		if (Traits::indexable)
+			erase_spans(node, pre, succ);
+		find_node_position(node, pre, succ);
+		retire_node(node);
+		return true;
 	}
 
-	uint64_t get_pool_uuid() {
-		PMEMoid oid = pmemobj_oid(this);
-		return oid.pool_uuid_lo;
+	/* Unlinks the marked nodes below @cutoff on every level, cutting each
+	 * run of them with one CAS. Inserts racing with expire_before() may
+	 * have linked live nodes in front of such runs, hence a walk from
+	 * _head rather than a single swing of its links. */
+	template <typename K>
+	void unlink_marked_before(const K &cutoff, uint64_t prefix) {
+		PMEMobjpool *pop = get_objpool();
+		for (int lv = top_level; lv >= 0; lv--) {
+			node_ptr node = head_node();
+			while (true) {
+				node_pptr link = node->get_next_pptr(pop, lv);
+				if (link.isDelete()) {
+					/* @node was erased meanwhile: start the level over */
+					node = head_node();
+					continue;
+				}
+				node_ptr next = link.getVptr(pop);
+				node_ptr live = next;
+				while (!live->isTail() && live->get_next_pptr(pop, lv).isDelete())
+					live = live->load_next_ptr(pop, lv);
+				if (live != next && !node->link_next_pptr(pop, lv, link, to_pptr(live)))
+					continue;
+				if (live->isTail() || !node_less(live, cutoff, prefix))
+					break;
+				node = live;
+			}
+		}
+	}
+
+	/* Versioned lists hand out write stamps in order and commit them in the
+	 * same order, so a snapshot at the committed stamp sees every write up
+	 * to it complete. No-ops otherwise. */
+	uint64_t begin_version() {
+		if (!Traits::versioned)
+			return 0;
+		return _runtime->clock.fetch_add(1) + 1;
+	}
+
+	/* A stamp from begin_version(). Every later stamp waits for it, so it
+	 * is committed when it goes out of scope at the latest, also when the
+	 * write throws; the nodes stamped by then are complete. */
+	class version_stamp {
+	public:
+		explicit version_stamp(self_type *list) : _list(list), _ts(list->begin_version()) {}
+		~version_stamp() {
+			commit();
+		}
+		version_stamp(const version_stamp &) = delete;
+		version_stamp &operator=(const version_stamp &) = delete;
+
+		uint64_t ts() const {
+			return _ts;
+		}
+
+		void commit() {
+			if (!_list)
+				return;
+			_list->commit_version(_ts);
+			_list = nullptr;
+		}
+	private:
+		self_type *_list;
+		uint64_t _ts;
+	};
+
+	void commit_version(uint64_t ts) {
+		if (!Traits::versioned)
+			return;
+		while (_runtime->committed.load(std::memory_order_acquire) != ts - 1)
+			std::this_thread::yield();
+		_runtime->committed.store(ts, std::memory_order_release);
+	}
+
+	/* versioned erase: @node stays linked as an old version until no
+	 * snapshot can see it */
+	size_type hide_node(node_ptr node) {
+		version_stamp stamp(this);
+		uint64_t ts = stamp.ts();
+		bool hidden = node->hide(get_objpool(), ts);
+		flushed_later();
+		stamp.commit();
+		if (!hidden)
+			return 0;
+		_size.fetch_sub(1, std::memory_order_relaxed);
+		retire_version(node, ts);
+		return 1;
+	}
+
+	/* Versioned update: links @newNode in front of the live @node and hides
+	 * @node with the stamp @newNode is created with. If @node was hidden by
+	 * another writer meanwhile, @newNode is hidden with that same stamp,
+	 * so no snapshot ever sees it, and false is returned. */
+	bool replace_version(node_ptr node, node_pptr newNode) {
+		PMEMobjpool *pop = get_objpool();
+		node_ptr fresh = newNode.getVptr(pop);
+		node_array pre, succ;
+		version_stamp stamp(this);
+		uint64_t ts = stamp.ts();
+		fresh->set_created(ts);
+		hash_announce(fresh);
+		fresh->begin_linking();
+		do {
+			find_node_position(fresh, pre, succ);
+			for (uint8_t i = 0; i < fresh->levels(); i++)
+				fresh->set_next_pptr(i, to_pptr(succ[i]));
+			fresh->flush_node(pop);
+			flushed_later();
+		} while (!link_next(pre[0], 0, to_pptr(succ[0]), newNode));
+		bool replaced = node->hide(pop, ts);
+		if (!replaced)
+			fresh->hide(pop, ts);
+		flushed_later();
+		stamp.commit();
+		if (replaced)
+			link_tower(fresh, pre, succ);
+		else
+			finish_tower(fresh, pre, succ);
+		retire_version(replaced ? node : fresh, ts);
+		return replaced;
+	}
+
+	/* queues @node, hidden at @ts, to be purged once no snapshot sees it */
+	void retire_version(node_ptr node, uint64_t ts) {
+		/* searches start from visible nodes only */
+		if (Traits::hybrid_index && node->height() > 1)
+			index_remove(node);
+		std::vector<node_ptr> ready;
+		{
+			std::lock_guard<std::mutex> lock(_runtime->versions);
+			_runtime->hidden.emplace(ts, node);
+			collect_versions(ready);
+		}
+		purge_nodes(ready);
+	}
+
+	void release_snapshot(uint64_t ts) {
+		epoch_guard guard(epoch());
+		std::vector<node_ptr> ready;
+		{
+			std::lock_guard<std::mutex> lock(_runtime->versions);
+			_runtime->snapshots.erase(_runtime->snapshots.find(ts));
+			collect_versions(ready);
+		}
+		purge_nodes(ready);
+	}
+
+	/* moves the hidden nodes no snapshot can see any more to @ready; the
+	 * caller holds the versions lock */
+	void collect_versions(std::vector<node_ptr> &ready) {
+		uint64_t horizon = _runtime->committed.load(std::memory_order_acquire);
+		if (!_runtime->snapshots.empty())
+			horizon = std::min(horizon, *_runtime->snapshots.begin());
+		auto &hidden = _runtime->hidden;
+		auto end = hidden.upper_bound(horizon);
+		for (auto it = hidden.begin(); it != end; ++it)
+			ready.push_back(it->second);
+		hidden.erase(hidden.begin(), end);
+	}
+
+	void purge_nodes(const std::vector<node_ptr> &nodes) {
+		node_array pre, succ;
+		for (node_ptr node : nodes)
+			unlink_node(node, pre, succ);
+	}
+
+	/* Snapshots do not survive a restart: every hidden version is purged
+	 * and the clock resumes after the newest stamp found. */
+	void recover_versions() {
+		PMEMobjpool *pop = get_objpool();
+		uint64_t newest = 0;
+		std::vector<node_ptr> hidden;
+		for (node_ptr node = head_node()->load_next_ptr(pop, 0); !node->isTail(); node = node->load_next_ptr(pop, 0)) {
+			newest = std::max(newest, std::max(node->created(), node->deleted()));
+			if (node->hidden() && !node->load_next_pptr(0).isDelete())
+				hidden.push_back(node);
+		}
+		_runtime->clock.store(newest);
+		_runtime->committed.store(newest);
+		epoch_guard guard(epoch());
+		purge_nodes(hidden);
+		LOG4P_DEBUG("purged %zu hidden versions", hidden.size());
+	}
+
+	node_pptr to_pptr(node_ptr node) {
+		return node_pptr((uint64_t)node - (uint64_t)get_objpool(), false, false);
+	}
+
+	/* resolved once by runtime_initialize(), no range tree lookup per hop */
+	PMEMobjpool *get_objpool() const {
+		return _runtime->pop;
 	}
 
-	pool_base get_pool_base() {
+	uint64_t get_pool_uuid() const {
+		return _runtime->uuid;
+	}
+
+	pool_base get_pool_base() const {
 		return pool_base(get_objpool());
 	}
+
+	/* three-way order of a node (with its cached prefix) against @key */
 	template <typename K>
-	bool is_after_node(const K& key, node_ptr node) const {
-        return (!node->isTail()) && (_compare(node->getKey(), key));
-    }
+	int key_cmp(node_ptr node, uint64_t node_prefix, const K &key, uint64_t prefix) {
+		stats_type::add(stat::comparisons);
+		if (prefix_type::enabled && node_prefix != prefix)
+			return node_prefix < prefix ? -1 : 1;
+		count_key_read(node);
+		if (_compare(node->getKey(), key))
+			return -1;
+		return _compare(key, node->getKey()) ? 1 : 0;
+	}
+
+	/* a descent over @levels levels */
+	static void count_search(int levels) {
+		stats_type::add(stat::searches);
+		stats_type::add(stat::levels, levels);
+		stats_type::trace(trace_event::search, levels);
+	}
+
+	/* a search read the link of @node on @level */
+	static void count_link(node_ptr node, int level) {
+		if (stats_type::enabled)
+			stats_type::touch(node->next_addr(level), sizeof(node_pptr));
+	}
+
+	/* a comparison read the cached prefix of @node */
+	static void count_prefix_read(node_ptr node) {
+		if (stats_type::enabled && prefix_type::enabled)
+			stats_type::touch(node->prefix_addr(), sizeof(uint64_t));
+	}
+
+	/* a comparison read the key of @node itself */
+	static void count_key_read(node_ptr node) {
+		stats_type::add(stat::key_reads);
+		if (stats_type::enabled)
+			stats_type::touch(&node->getKey(), sizeof(key_type));
+	}
+
+	static void count_cas_retry(int level) {
+		stats_type::add(stat::cas_retries);
+		stats_type::trace(trace_event::cas_retry, level);
+	}
+
+	/* node key < @key; the cached prefixes decide unless they tie */
+	template <typename K>
+	bool node_less(node_ptr node, const K &key, uint64_t prefix) {
+		stats_type::add(stat::comparisons);
+		count_prefix_read(node);
+		if (prefix_type::enabled && node->key_prefix() != prefix)
+			return node->key_prefix() < prefix;
+		count_key_read(node);
+		return _compare(node->getKey(), key);
+	}
+
+	/* @key < node key */
+	template <typename K>
+	bool key_less(const K &key, uint64_t prefix, node_ptr node) {
+		stats_type::add(stat::comparisons);
+		count_prefix_read(node);
+		if (prefix_type::enabled && node->key_prefix() != prefix)
+			return prefix < node->key_prefix();
+		count_key_read(node);
+		return _compare(key, node->getKey());
+	}
 };
 
 } /* namespace internal */
 
 template <typename Key, typename Value, typename Compare = std::less<Key>,
-	  std::size_t height = 8, std::size_t branch = 4>
-class persistent_skiplist : public internal::persistent_skiplist_base<Key, Value, Compare, height, branch> {
+	  std::size_t height = 8, std::size_t branch = 4, typename Traits = default_skiplist_traits>
+class persistent_skiplist : public internal::persistent_skiplist_base<Key, Value, Compare, height, branch, Traits> {
 private:
-	using base_type = internal::persistent_skiplist_base<Key, Value, Compare, height, branch>;
+	using base_type = internal::persistent_skiplist_base<Key, Value, Compare, height, branch, Traits>;
 
 public:
 	using base_type::begin;
 	using base_type::end;
+	using base_type::rbegin;
+	using base_type::rend;
 	using base_type::erase;
 	using base_type::find;
 	using base_type::try_emplace;
+	using base_type::insert_or_assign;
+	using base_type::assign;
+	using base_type::update;
+	using base_type::upsert;
+	using base_type::insert_batch;
+	using base_type::emplace_batch;
+	using base_type::bulk_load;
+	using base_type::scan;
 
 	/* type definitions */
 	using key_type = typename base_type::key_type;
@@ -569,7 +3425,9 @@ public:
 	using value_type = typename base_type::value_type;
 	using iterator = typename base_type::iterator;
 	using const_iterator = typename base_type::const_iterator;
-	// using reverse_iterator = typename base_type::reverse_iterator;
+	using reverse_iterator = typename base_type::reverse_iterator;
+	using const_reverse_iterator = typename base_type::const_reverse_iterator;
+	using snapshot_type = typename base_type::snapshot_type;
 
 	explicit persistent_skiplist() : base_type()
 	{
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef PERSISTENT_TWO_LEVEL_SKIPLIST
+#define PERSISTENT_TWO_LEVEL_SKIPLIST
+
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "persistent_skiplist.h"
+
+namespace pmem
+{
+namespace kv
+{
+
+namespace internal
+{
+
+/* search key referring to a primary key owned by the caller */
+template <typename P, typename TsKey>
+struct two_level_probe {
+	const P &pkey;
+	TsKey ts;
+};
+
+/* primary keys ascending, the timestamps of one primary key descending */
+template <typename Compare>
+struct two_level_compare {
+	Compare pkey_less;
+
+	template <typename A, typename B>
+	bool operator()(const A &a, const B &b) const {
+		if (pkey_less(a.pkey, b.pkey))
+			return true;
+		if (pkey_less(b.pkey, a.pkey))
+			return false;
+		return b.ts < a.ts;
+	}
+};
+
+} /* namespace internal */
+
+/* stored key of a two-level list; built inside the node's transaction */
+template <typename PKey, typename TsKey>
+struct two_level_key {
+	PKey pkey;
+	TsKey ts;
+
+	template <typename P>
+	two_level_key(const internal::two_level_probe<P, TsKey> &probe)
+		: pkey(probe.pkey), ts(probe.ts) {}
+};
+
+/*
+ * Double-layered skiplist as used by RTIDB: every primary key owns a run of
+ * records ordered by timestamp, newest first. Both layers are one
+ * persistent_skiplist ordered by (primary key, timestamp descending), so an
+ * inner list is a contiguous stretch of level 0. All inner lists share the
+ * pool, the volatile runtime and the allocation path of the outer one; a new
+ * primary key costs no more than the transaction of its first record.
+ * Timestamps must be numeric.
+ */
+template <typename PKey, typename TsKey, typename Value, typename Compare = std::less<PKey>,
+	  std::size_t height = 8, std::size_t branch = 4, typename Traits = default_skiplist_traits>
+class persistent_two_level_skiplist {
+private:
+	static_assert(std::numeric_limits<TsKey>::is_specialized, "timestamps must be numeric");
+
+	using list_type = persistent_skiplist<two_level_key<PKey, TsKey>, Value,
+		internal::two_level_compare<Compare>, height, branch, Traits>;
+	using ts_limits = std::numeric_limits<TsKey>;
+	template <typename P>
+	using probe = internal::two_level_probe<P, TsKey>;
+
+public:
+	using key_type = two_level_key<PKey, TsKey>;
+	using mapped_type = Value;
+	using value_type = typename list_type::value_type;
+	using size_type = std::size_t;
+	using iterator = typename list_type::iterator;
+	using const_iterator = typename list_type::const_iterator;
+
+	persistent_two_level_skiplist() = default;
+	persistent_two_level_skiplist(const persistent_two_level_skiplist &) = delete;
+	persistent_two_level_skiplist &operator=(const persistent_two_level_skiplist &) = delete;
+
+	void runtime_initialize() {
+		_list.runtime_initialize();
+	}
+
+	void runtime_finalize() {
+		_list.runtime_finalize();
+	}
+
+	/* Adds the record of @pkey at @ts in one transaction; returns the
+	 * existing record and false if there is one. */
+	template <typename P, typename V>
+	std::pair<iterator, bool> insert(const P &pkey, TsKey ts, V &&value) {
+		return _list.try_emplace(probe<P>{pkey, ts}, std::forward<V>(value));
+	}
+
+	template <typename P>
+	iterator find(const P &pkey, TsKey ts) {
+		return _list.find(probe<P>{pkey, ts});
+	}
+
+	template <typename P>
+	size_type erase(const P &pkey, TsKey ts) {
+		return _list.erase(probe<P>{pkey, ts});
+	}
+
+	/* Removes every record of @pkey; returns how many there were. */
+	template <typename P>
+	size_type erase(const P &pkey) {
+		std::vector<TsKey> stamps;
+		for_range(pkey, ts_limits::lowest(), ts_limits::max(), std::numeric_limits<size_type>::max(),
+			[&](TsKey ts, const Value &) {
+				stamps.push_back(ts);
+				return true;
+			});
+		size_type erased = 0;
+		for (TsKey ts : stamps)
+			erased += erase(pkey, ts);
+		return erased;
+	}
+
+	/* Calls @f(ts, value) on the newest @k records of @pkey, newest first,
+	 * until @f returns false. Returns the number of records visited. */
+	template <typename P, typename F>
+	size_type latest(const P &pkey, size_type k, F &&f) {
+		return for_range(pkey, ts_limits::lowest(), ts_limits::max(), k, std::forward<F>(f));
+	}
+
+	/* Calls @f(ts, value) on the records of @pkey with @from <= ts <= @to,
+	 * newest first, until @f returns false. Returns the number visited. */
+	template <typename P, typename F>
+	size_type time_range(const P &pkey, TsKey from, TsKey to, F &&f) {
+		return for_range(pkey, from, to, std::numeric_limits<size_type>::max(), std::forward<F>(f));
+	}
+
+	/* the newest record of @pkey, or end() */
+	template <typename P>
+	iterator latest(const P &pkey) {
+		iterator it = _list.lower_bound(probe<P>{pkey, ts_limits::max()});
+		if (it != end() && (_compare.pkey_less(pkey, it->first.pkey) || _compare.pkey_less(it->first.pkey, pkey)))
+			return end();
+		return it;
+	}
+
+	/* every record, by primary key and then newest first */
+	iterator begin() {
+		return _list.begin();
+	}
+	iterator end() {
+		return _list.end();
+	}
+
+	size_type size() const noexcept {
+		return _list.size();
+	}
+
+	size_type reclaim() {
+		return _list.reclaim();
+	}
+
+private:
+	list_type _list;
+	internal::two_level_compare<Compare> _compare;
+
+	template <typename P, typename F>
+	size_type for_range(const P &pkey, TsKey from, TsKey to, size_type limit, F &&f) {
+		return _list.scan(probe<P>{pkey, to}, probe<P>{pkey, from}, 0, limit, [&](const value_type &e) {
+			return f(e.first.ts, e.second);
+		});
+	}
+};
+
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // PERSISTENT_TWO_LEVEL_SKIPLIST
@@ -0,0 +1,71 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef SKIPLIST_PERSIST
+#define SKIPLIST_PERSIST
+
+#include <cstddef>
+
+#include <libpmemobj.h>
+
+namespace pmem
+{
+namespace kv
+{
+
+/*
+ * persist options: how a list makes its own writes durable. Transactions,
+ * which allocate nodes and out-of-line values, are not affected.
+ *
+ * A link is published by a CAS with kDirtyFlag set and then flushed; the
+ * flag is cleared once the link is durable, and a thread relying on a link
+ * still flagged persists it first. A new node is flushed together with its
+ * tower as one range before its level-0 link is published.
+ */
+
+/* Flushes are not drained before the writes that depend on them: the CAS
+ * publishing such a write is a locked instruction, which orders the
+ * earlier CLWB/CLFLUSHOPT of its thread. An operation drains once at its
+ * end and then clears the flag of the links it published. */
+struct batched_persist {
+	static constexpr bool flushes = true;
+	static constexpr bool per_operation = true;
+
+	static void flush(PMEMobjpool *pop, const void *addr, size_t len) {
+		pmemobj_flush(pop, addr, len);
+	}
+	static void drain(PMEMobjpool *pop) {
+		pmemobj_drain(pop);
+	}
+};
+
+/* every flush is drained before the next write, every link is durable
+ * before the next one is published; for platforms where a CAS does not
+ * order flushes */
+struct strict_persist {
+	static constexpr bool flushes = true;
+	static constexpr bool per_operation = false;
+
+	static void flush(PMEMobjpool *pop, const void *addr, size_t len) {
+		pmemobj_flush(pop, addr, len);
+	}
+	static void drain(PMEMobjpool *pop) {
+		pmemobj_drain(pop);
+	}
+};
+
+/* nothing is flushed and links are published clean; for tests and for
+ * measuring the cost of persistence. A crash keeps whatever the caches
+ * happened to write back. */
+struct volatile_persist {
+	static constexpr bool flushes = false;
+	static constexpr bool per_operation = true;
+
+	static void flush(PMEMobjpool *, const void *, size_t) {}
+	static void drain(PMEMobjpool *) {}
+};
+
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // SKIPLIST_PERSIST
@@ -0,0 +1,228 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef SKIPLIST_STATS
+#define SKIPLIST_STATS
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#include "epoch.h"
+
+namespace pmem
+{
+namespace kv
+{
+
+/* hot-path counters of a list, see counting_stats */
+enum class stat : uint8_t {
+	searches,    /* descents towards a key */
+	levels,      /* levels walked by those descents */
+	comparisons, /* key comparisons, a tie-free prefix comparison included */
+	key_reads,   /* comparisons that read the node's key, no prefix or a tie */
+	pmem_lines,  /* cache lines of links, prefixes and keys read by searches */
+	cas_retries, /* link or value CASes that lost a race */
+	persists,    /* flushes issued, with or without their own drain */
+	dirty_helps, /* dirty links made durable for another thread */
+	tx_aborts,   /* transactions that threw */
+	count
+};
+
+/* totals over every thread, taken by snapshot() */
+struct stats_snapshot {
+	uint64_t searches = 0;
+	uint64_t levels = 0;
+	uint64_t comparisons = 0;
+	uint64_t key_reads = 0;
+	uint64_t pmem_lines = 0;
+	uint64_t cas_retries = 0;
+	uint64_t persists = 0;
+	uint64_t dirty_helps = 0;
+	uint64_t tx_aborts = 0;
+
+	/* the counts between two snapshots */
+	stats_snapshot operator-(const stats_snapshot &before) const {
+		stats_snapshot d;
+		d.searches = searches - before.searches;
+		d.levels = levels - before.levels;
+		d.comparisons = comparisons - before.comparisons;
+		d.key_reads = key_reads - before.key_reads;
+		d.pmem_lines = pmem_lines - before.pmem_lines;
+		d.cas_retries = cas_retries - before.cas_retries;
+		d.persists = persists - before.persists;
+		d.dirty_helps = dirty_helps - before.dirty_helps;
+		d.tx_aborts = tx_aborts - before.tx_aborts;
+		return d;
+	}
+};
+
+/* events of tracing_stats; arg holds the level, for insert the height */
+enum class trace_event : uint32_t {
+	search,
+	insert,
+	erase,
+	cas_retry,
+	dirty_help,
+	tx_abort
+};
+
+struct trace_record {
+	uint64_t seq;     /* position in the trace */
+	uint64_t time_ns; /* steady_clock */
+	uint32_t thread;  /* fourpd::thread_index() */
+	trace_event event;
+	uint64_t arg;
+};
+
+/* stats option: nothing is counted, every hook compiles to nothing */
+struct no_stats {
+	static constexpr bool enabled = false;
+
+	static void add(stat, uint64_t = 1) {}
+	static void touch(const void *, size_t) {}
+	static void trace(trace_event, uint64_t = 0) {}
+	static stats_snapshot snapshot() {
+		return stats_snapshot();
+	}
+};
+
+/*
+ * stats option: one cache line of counters per thread index, written only
+ * by its thread without atomic read-modify-writes; snapshot() sums them.
+ * The counters belong to the option type, so lists that should be counted
+ * apart need a different @Tag.
+ */
+template <typename Tag = void>
+struct counting_stats {
+	static constexpr bool enabled = true;
+
+	static void add(stat s, uint64_t n = 1) {
+		std::atomic<uint64_t> &c = local().counts[static_cast<size_t>(s)];
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	/* counts the cache lines of [@addr, @addr + @n) as pmem_lines, but
+	 * not those among the last kRecentLines this thread read. Only the
+	 * key object itself is counted, not storage it points to. */
+	static void touch(const void *addr, size_t n) {
+		block &b = local();
+		for (uintptr_t line = uintptr_t(addr) / 64; line <= (uintptr_t(addr) + n - 1) / 64; line++) {
+			if (std::find(b.recent.begin(), b.recent.end(), line) != b.recent.end())
+				continue;
+			b.recent[b.next_recent++ % kRecentLines] = line;
+			add(stat::pmem_lines);
+		}
+	}
+
+	static void trace(trace_event, uint64_t = 0) {}
+
+	static stats_snapshot snapshot() {
+		std::array<uint64_t, size_t(stat::count)> sum{};
+		for (auto &b : blocks())
+			for (size_t i = 0; i < sum.size(); i++)
+				sum[i] += b.counts[i].load(std::memory_order_relaxed);
+		stats_snapshot s;
+		s.searches = sum[size_t(stat::searches)];
+		s.levels = sum[size_t(stat::levels)];
+		s.comparisons = sum[size_t(stat::comparisons)];
+		s.key_reads = sum[size_t(stat::key_reads)];
+		s.pmem_lines = sum[size_t(stat::pmem_lines)];
+		s.cas_retries = sum[size_t(stat::cas_retries)];
+		s.persists = sum[size_t(stat::persists)];
+		s.dirty_helps = sum[size_t(stat::dirty_helps)];
+		s.tx_aborts = sum[size_t(stat::tx_aborts)];
+		return s;
+	}
+
+private:
+	static constexpr size_t kRecentLines = 8;
+
+	struct alignas(64) block {
+		std::array<std::atomic<uint64_t>, size_t(stat::count)> counts{};
+		/* of touch(), used by its thread only */
+		std::array<uintptr_t, kRecentLines> recent{};
+		size_t next_recent = 0;
+	};
+
+	static std::array<block, fourpd::kMaxThreads> &blocks() {
+		static std::array<block, fourpd::kMaxThreads> b;
+		return b;
+	}
+
+	static block &local() {
+		static thread_local block *mine = &blocks()[fourpd::thread_index()];
+		return *mine;
+	}
+};
+
+/*
+ * counting_stats that also keeps the last @Capacity events in a ring.
+ * Writers claim a position with one fetch_add and publish the record under
+ * a per-slot sequence number; trace() skips records that were being
+ * overwritten while it copied them.
+ */
+template <std::size_t Capacity = 4096, typename Tag = void>
+struct tracing_stats : counting_stats<Tag> {
+	static_assert((Capacity & (Capacity - 1)) == 0, "the capacity must be a power of 2");
+
+	static void trace(trace_event event, uint64_t arg = 0) {
+		uint64_t pos = ring().next.fetch_add(1, std::memory_order_relaxed);
+		slot &s = ring().slots[pos & (Capacity - 1)];
+		s.seq.store(2 * pos + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		s.time_ns.store(std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count(), std::memory_order_relaxed);
+		s.info.store(uint64_t(fourpd::thread_index()) << 32 | uint32_t(event), std::memory_order_relaxed);
+		s.arg.store(arg, std::memory_order_relaxed);
+		s.seq.store(2 * pos + 2, std::memory_order_release);
+	}
+
+	/* the records still in the ring, oldest first */
+	static std::vector<trace_record> records() {
+		std::vector<trace_record> out;
+		uint64_t end = ring().next.load(std::memory_order_acquire);
+		for (uint64_t pos = end > Capacity ? end - Capacity : 0; pos < end; pos++) {
+			slot &s = ring().slots[pos & (Capacity - 1)];
+			uint64_t seq = s.seq.load(std::memory_order_acquire);
+			trace_record r;
+			r.seq = pos;
+			r.time_ns = s.time_ns.load(std::memory_order_relaxed);
+			uint64_t info = s.info.load(std::memory_order_relaxed);
+			r.arg = s.arg.load(std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (seq != 2 * pos + 2 || s.seq.load(std::memory_order_relaxed) != seq)
+				continue;
+			r.thread = uint32_t(info >> 32);
+			r.event = trace_event(uint32_t(info));
+			out.push_back(r);
+		}
+		return out;
+	}
+
+private:
+	struct slot {
+		std::atomic<uint64_t> seq{0};
+		std::atomic<uint64_t> time_ns{0};
+		std::atomic<uint64_t> info{0};
+		std::atomic<uint64_t> arg{0};
+	};
+
+	struct ring_type {
+		alignas(64) std::atomic<uint64_t> next{0};
+		alignas(64) std::array<slot, Capacity> slots;
+	};
+
+	static ring_type &ring() {
+		static ring_type r;
+		return r;
+	}
+};
+
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // SKIPLIST_STATS
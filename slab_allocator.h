@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef SLAB_ALLOCATOR
+#define SLAB_ALLOCATOR
+
+#include <libpmemobj.h>
+#include <libpmemobj++/pexceptions.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "epoch.h"
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/*
+ * Fixed-size slots in per-class chunks of pmem, one class per node height.
+ * A chunk is allocated and linked at the head of a persistent chain in the
+ * transaction that needed it, so an abort takes back both. Which slots are
+ * free is only known in DRAM: after opening the pool the
+ * owner marks every slot still holding a reachable node and the rest become
+ * free again, which also takes back slots lost to a crash or an aborted
+ * transaction. Threads take and give slots through their own cache and
+ * trade batches of them with a shared pool.
+ */
+template <size_t Classes>
+class slab_allocator {
+public:
+	/* persistent part, kept in the owning object */
+	struct root {
+		PMEMoid chunks = OID_NULL;
+	};
+
+	slab_allocator() : _pop(nullptr), _root(nullptr) {}
+
+	slab_allocator(const slab_allocator &) = delete;
+	slab_allocator &operator=(const slab_allocator &) = delete;
+
+	/* @slot_size(c) is the number of bytes needed by class c */
+	template <typename SlotSize>
+	void attach(PMEMobjpool *pop, root *r, SlotSize &&slot_size) {
+		_pop = pop;
+		_root = r;
+		for (size_t c = 0; c < Classes; c++)
+			_slot_size[c] = (slot_size(c) + kAlign - 1) & ~(kAlign - 1);
+		_caches.reset(new thread_cache[fourpd::kMaxThreads]);
+	}
+
+	size_t slot_size(size_t c) const {
+		return _slot_size[c];
+	}
+
+	/* in a transaction */
+	void *take(size_t c) {
+		thread_cache &tc = _caches[fourpd::thread_index()];
+		std::vector<void *> *from = tc.fresh[c].empty() ? &tc.slots[c] : &tc.fresh[c];
+		if (from->empty())
+			from = &refill(c, tc);
+		void *slot = from->back();
+		from->pop_back();
+		return slot;
+	}
+
+	/* @slot must not hold a live object any more */
+	void give(void *slot, size_t c) {
+		thread_cache &tc = _caches[fourpd::thread_index()];
+		if (tc.owns(slot)) {
+			tc.fresh[c].push_back(slot);
+			return;
+		}
+		std::vector<void *> &cache = tc.slots[c];
+		cache.push_back(slot);
+		if (cache.size() < 2 * kBatch)
+			return;
+		std::lock_guard<std::mutex> g(_lock);
+		_shared[c].insert(_shared[c].end(), cache.end() - kBatch, cache.end());
+		cache.resize(cache.size() - kBatch);
+	}
+
+	/* Free slot recovery: begin_rebuild(), mark_used() on every slot of a
+	 * reachable node, which may run in parallel, then end_rebuild(). Must
+	 * not overlap with take() or give(). */
+	void begin_rebuild() {
+		_map.clear();
+		for (PMEMoid oid = _root->chunks; !OID_IS_NULL(oid);) {
+			chunk *ch = static_cast<chunk *>(pmemobj_direct(oid));
+			_map.push_back({ch->slot(0), ch->slot(ch->slots), ch, std::vector<uint8_t>(ch->slots, 0)});
+			oid = ch->next;
+		}
+		std::sort(_map.begin(), _map.end(), [](const chunk_map &a, const chunk_map &b) {
+			return a.begin < b.begin;
+		});
+	}
+
+	void mark_used(const void *slot) {
+		const char *p = static_cast<const char *>(slot);
+		auto it = std::upper_bound(_map.begin(), _map.end(), p, [](const char *p, const chunk_map &m) {
+			return p < m.begin;
+		});
+		if (it == _map.begin() || p >= (--it)->end)
+			return;
+		it->used[(p - it->begin) / it->ch->slot_size] = 1;
+	}
+
+	/* returns the number of free slots */
+	size_t end_rebuild() {
+		size_t free = 0;
+		for (auto &c : _shared)
+			c.clear();
+		for (size_t t = 0; t < fourpd::kMaxThreads; t++)
+			for (auto &c : _caches[t].slots)
+				c.clear();
+		for (auto &m : _map) {
+			for (size_t i = m.ch->slots; i-- > 0;) {
+				if (!m.used[i]) {
+					_shared[m.ch->size_class].push_back(m.ch->slot(i));
+					free++;
+				}
+			}
+		}
+		_map.clear();
+		_map.shrink_to_fit();
+		return free;
+	}
+
+private:
+	static constexpr size_t kAlign = 64;
+	static constexpr size_t kBatch = 64;
+	static constexpr size_t kChunkBytes = size_t(1) << 20;
+	static constexpr uint64_t kChunkType = 0x51ab;
+
+	struct chunk {
+		PMEMoid next;
+		uint64_t slot_size;
+		uint64_t slots;
+		uint64_t size_class;
+
+		char *slot(size_t i) {
+			return reinterpret_cast<char *>(this) + kAlign + i * slot_size;
+		}
+	};
+	static_assert(sizeof(chunk) <= kAlign, "chunk header exceeds its slot");
+
+	struct chunk_map {
+		char *begin, *end;
+		chunk *ch;
+		std::vector<uint8_t> used;
+	};
+
+	/* a thread's free slots, and those of the chunks its running transaction
+	 * allocated, which stay with it until the transaction commits */
+	struct thread_cache {
+		std::array<std::vector<void *>, Classes> slots;
+		std::array<std::vector<void *>, Classes> fresh;
+		std::vector<chunk *> chunks;
+		bool growing = false;
+
+		bool owns(const void *slot) const {
+			const char *p = static_cast<const char *>(slot);
+			for (chunk *ch : chunks)
+				if (p >= ch->slot(0) && p < ch->slot(ch->slots))
+					return true;
+			return false;
+		}
+	};
+
+	PMEMobjpool *_pop;
+	root *_root;
+	std::array<size_t, Classes> _slot_size;
+	std::unique_ptr<thread_cache[]> _caches;
+	std::mutex _lock;
+	/* held by a transaction that linked a chunk, until it ends */
+	std::mutex _grow_lock;
+	std::array<std::vector<void *>, Classes> _shared;
+	std::vector<chunk_map> _map;
+
+	/* the vector of @tc holding at least one free slot of class @c */
+	std::vector<void *> &refill(size_t c, thread_cache &tc) {
+		{
+			std::lock_guard<std::mutex> g(_lock);
+			std::vector<void *> &shared = _shared[c];
+			if (!shared.empty()) {
+				/* a copy: std::min() would odr-use kBatch */
+				const size_t batch = kBatch;
+				size_t n = std::min(batch, shared.size());
+				tc.slots[c].insert(tc.slots[c].end(), shared.end() - n, shared.end());
+				shared.resize(shared.size() - n);
+				return tc.slots[c];
+			}
+		}
+		grow(c, tc);
+		return tc.fresh[c];
+	}
+
+	/* Links a chunk of class @c in the caller's transaction. Another
+	 * transaction could neither link its chunk to this one before it is
+	 * committed, nor take back the chain head on abort, so the chain stays
+	 * locked until the transaction ends. */
+	void grow(size_t c, thread_cache &tc) {
+		using pmem::obj::transaction;
+		if (!tc.growing) {
+			_grow_lock.lock();
+			try {
+				transaction::register_callback(transaction::stage::oncommit, [this, &tc] {
+					std::lock_guard<std::mutex> g(_lock);
+					for (size_t k = 0; k < Classes; k++)
+						_shared[k].insert(_shared[k].end(), tc.fresh[k].begin(), tc.fresh[k].end());
+					end_growing(tc);
+				});
+				transaction::register_callback(transaction::stage::onabort, [this, &tc] {
+					end_growing(tc);
+				});
+			} catch (...) {
+				_grow_lock.unlock();
+				throw;
+			}
+			tc.growing = true;
+		}
+		chunk header;
+		header.next = _root->chunks;
+		header.slot_size = _slot_size[c];
+		const size_t batch = kBatch;
+		header.slots = std::max(batch, (kChunkBytes - kAlign) / _slot_size[c]);
+		header.size_class = c;
+		/* the slots are written and flushed when they are taken */
+		PMEMoid oid = pmemobj_tx_xalloc(kAlign + header.slots * header.slot_size, kChunkType,
+			POBJ_XALLOC_NO_FLUSH | POBJ_XALLOC_NO_ABORT);
+		if (OID_IS_NULL(oid))
+			throw pmem::transaction_alloc_error("failed to allocate a slab chunk");
+		chunk *ch = static_cast<chunk *>(pmemobj_direct(oid));
+		*ch = header;
+		pmemobj_persist(_pop, ch, sizeof(chunk));
+		pmemobj_tx_add_range_direct(&_root->chunks, sizeof(PMEMoid));
+		_root->chunks = oid;
+		tc.chunks.push_back(ch);
+		for (size_t i = ch->slots; i-- > 0;)
+			tc.fresh[c].push_back(ch->slot(i));
+	}
+
+	void end_growing(thread_cache &tc) {
+		for (auto &f : tc.fresh)
+			f.clear();
+		tc.chunks.clear();
+		tc.growing = false;
+		_grow_lock.unlock();
+	}
+};
+
+/* takes the place of slab_allocator::root in lists without slabs */
+struct no_slab_root {};
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // SLAB_ALLOCATOR
@@ -51,19 +51,22 @@ public:
     explicit SmartPPtr(persistent_ptr<T> pptr): val(pptr.raw().off) {}
     explicit SmartPPtr(offset_type offset): val(offset) {}
 
-    offset_type getOffset(void) {
+    offset_type getOffset(void) const {
         return (val & ~mask);
     }
-    T * getVptr(PMEMobjpool * pool) {
+    T * getVptr(PMEMobjpool * pool) const {
         return (val == 0) ? nullptr : (T *) (((offset_type) pool + val ) & ~mask);
     }
-    persistent_ptr<T> getPptr(uint64_t pool_uuid) {
+    persistent_ptr<T> getPptr(uint64_t pool_uuid) const {
         return persistent_ptr<T>(PMEMoid{pool_uuid, val & ~mask});
     }
 
-    bool isDelete(void)  { return (val & kDeleteFlag); }
-    bool isDirty(void)   { return (val & kDirtyFlag);  }
+    bool isDelete(void) const { return (val & kDeleteFlag); }
+    bool isDirty(void)  const { return (val & kDirtyFlag);  }
     void clearDirty(void)  { val &= ~kDirtyFlag;  return; }
+
+    bool operator==(const SmartPPtr &other) const { return val == other.val; }
+    bool operator!=(const SmartPPtr &other) const { return val != other.val; }
 };
 
 // template<class T>
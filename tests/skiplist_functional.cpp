@@ -0,0 +1,722 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+/*
+ * skiplist_functional: runs every list operation on one thread, in each
+ * layout, and checks the results and the list's contents against a
+ * std::map after every step, before and after the pool is reopened. The
+ * two-level and sharded wrappers are checked the same way, and what
+ * snapshots of a versioned list see. Exits non-zero if anything does not
+ * match.
+ *
+ *   skiplist_functional [pool path]
+ */
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "persistent_sharded_skiplist.h"
+#include "persistent_skiplist.h"
+#include "persistent_two_level_skiplist.h"
+
+using namespace pmem::kv;
+using pmem::obj::make_persistent;
+using pmem::obj::persistent_ptr;
+using pmem::obj::pool;
+using pmem::obj::transaction;
+
+namespace
+{
+
+constexpr uint64_t kKeys = 300;
+
+using reference_map = std::map<uint64_t, uint64_t>;
+
+std::string pool_path = "/dev/shm/skiplist_functional";
+int failures = 0;
+
+void fail(const std::string &layout, const std::string &what, uint64_t key) {
+	fprintf(stderr, "%s: %s (key %llu)\n", layout.c_str(), what.c_str(), (unsigned long long)key);
+	failures++;
+}
+
+void expect(bool ok, const std::string &layout, const std::string &what, uint64_t key = 0) {
+	if (!ok)
+		fail(layout, what, key);
+}
+
+/* keys are their own order-preserving prefix */
+struct u64_prefix {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		return key;
+	}
+};
+
+struct u64_hash {
+	template <typename K>
+	uint64_t operator()(const K &key) const {
+		return uint64_t(key) * 0x9e3779b97f4a7c15ULL;
+	}
+};
+
+struct inline_traits : default_skiplist_traits {
+	static constexpr bool inline_tower = true;
+};
+struct prefix_traits : inline_traits {
+	using key_prefix = u64_prefix;
+};
+struct hybrid_traits : prefix_traits {
+	static constexpr bool hybrid_index = true;
+};
+struct slab_traits : prefix_traits {
+	static constexpr bool slab_allocator = true;
+};
+struct hash_traits : prefix_traits {
+	using key_hash = u64_hash;
+};
+struct indexable_traits : default_skiplist_traits {
+	static constexpr bool indexable = true;
+};
+struct versioned_traits : default_skiplist_traits {
+	static constexpr bool versioned = true;
+};
+struct ool_traits : default_skiplist_traits {
+	using value_placement = out_of_line_values<16>;
+};
+
+template <typename T>
+struct test_root {
+	persistent_ptr<T> object;
+};
+
+/* a pool holding one @T, created empty and reopened on demand */
+template <typename T>
+class fixture {
+public:
+	fixture() {
+		::unlink(pool_path.c_str());
+		_pop = pool<test_root<T>>::create(pool_path, "skiplist_functional", 256 << 20, S_IWUSR | S_IRUSR);
+		auto root = _pop.root();
+		transaction::run(_pop, [&] { root->object = make_persistent<T>(); });
+	}
+
+	~fixture() {
+		get().runtime_finalize();
+		_pop.close();
+		::unlink(pool_path.c_str());
+	}
+
+	T &get() {
+		return *_pop.root()->object;
+	}
+
+	/* closes and opens the pool; the caller rebuilds the runtime */
+	T &reopen() {
+		get().runtime_finalize();
+		_pop.close();
+		_pop = pool<test_root<T>>::open(pool_path, "skiplist_functional");
+		return get();
+	}
+
+private:
+	pool<test_root<T>> _pop;
+};
+
+/* ---------------------------------------------------------------- lists */
+
+template <typename Traits>
+using list_of = persistent_skiplist<uint64_t, uint64_t, std::less<uint64_t>, 8, 2, Traits>;
+
+template <typename List>
+void check_ranks(List &list, const reference_map &ref, const std::string &layout, std::false_type) {}
+
+template <typename List>
+void check_ranks(List &list, const reference_map &ref, const std::string &layout, std::true_type) {
+	for (uint64_t key = 0; key <= kKeys; key++) {
+		size_t rank = std::distance(ref.begin(), ref.lower_bound(key));
+		expect(list.rank(key) == rank, layout, "rank()", key);
+	}
+	for (size_t lo = 0; lo <= ref.size() + 1; lo += 13) {
+		auto range = list.range_by_index(lo, lo + 5);
+		auto want = ref.begin();
+		std::advance(want, std::min(lo, ref.size()));
+		size_t n = 0;
+		for (auto it = range.first; it != range.second; ++it, ++want, n++)
+			expect(want != ref.end() && it->first == want->first, layout, "range_by_index()", lo);
+		expect(n == std::min(ref.size(), lo + 5) - std::min(ref.size(), lo), layout, "range_by_index() length", lo);
+	}
+}
+
+/* every read path agrees with @ref */
+template <typename Traits>
+void check_list(list_of<Traits> &list, const reference_map &ref, const std::string &layout) {
+	using list_type = list_of<Traits>;
+	expect(list.size() == ref.size(), layout, "size() " + std::to_string(list.size()), ref.size());
+
+	auto want = ref.begin();
+	for (auto it = list.begin(); it != list.end(); ++it, ++want) {
+		if (want == ref.end() || it->first != want->first || it->second != want->second) {
+			fail(layout, "forward iteration", it->first);
+			break;
+		}
+	}
+	auto rwant = ref.rbegin();
+	for (auto it = list.rbegin(); it != list.rend(); ++it, ++rwant) {
+		if (rwant == ref.rend() || it->first != rwant->first) {
+			fail(layout, "reverse iteration", it->first);
+			break;
+		}
+	}
+
+	for (uint64_t key = 0; key <= kKeys; key++) {
+		auto it = list.find(key);
+		auto r = ref.find(key);
+		expect((it == list.end()) == (r == ref.end()), layout, "find() presence", key);
+		if (it != list.end() && r != ref.end())
+			expect(it->first == key && it->second == r->second, layout, "find() element", key);
+
+		auto lb = list.lower_bound(key);
+		auto rlb = ref.lower_bound(key);
+		expect((lb == list.end()) == (rlb == ref.end()) && (lb == list.end() || lb->first == rlb->first),
+		       layout, "lower_bound()", key);
+		auto ub = list.upper_bound(key);
+		auto rub = ref.upper_bound(key);
+		expect((ub == list.end()) == (rub == ref.end()) && (ub == list.end() || ub->first == rub->first),
+		       layout, "upper_bound()", key);
+		auto rl = list.rlower_bound(key);
+		bool none = rub == ref.begin();
+		expect((rl == list.rend()) == none && (none || rl->first == std::prev(rub)->first), layout,
+		       "rlower_bound()", key);
+	}
+
+	size_t pos = 0;
+	for (auto r = ref.begin(); r != ref.end(); ++r, pos++) {
+		if (pos % 17 == 0)
+			expect(list[pos].first == r->first, layout, "operator[]", pos);
+	}
+	check_ranks(list, ref, layout, std::integral_constant<bool, Traits::indexable>());
+
+	std::mt19937_64 rng(ref.size());
+	for (int i = 0; i < 20; i++) {
+		uint64_t lo = rng() % kKeys, hi = lo + rng() % 64;
+		size_t offset = rng() % 4, limit = 1 + rng() % 32;
+		std::vector<uint64_t> got, expected;
+		size_t visited = list.scan(lo, hi, offset, limit, [&](const typename list_type::value_type &e) {
+			got.push_back(e.first);
+			return true;
+		});
+		size_t skip = offset;
+		for (auto r = ref.lower_bound(lo); r != ref.upper_bound(hi) && expected.size() < limit; ++r) {
+			if (skip > 0)
+				skip--;
+			else
+				expected.push_back(r->first);
+		}
+		expect(got == expected && visited == got.size(), layout, "scan() with offset and limit", lo);
+
+		got.clear();
+		expected.clear();
+		list.reverse_range_scan(lo, hi, [&](const typename list_type::value_type &e) {
+			got.push_back(e.first);
+			return got.size() < limit;
+		});
+		for (auto r = ref.upper_bound(hi); r != ref.lower_bound(lo) && expected.size() < limit;)
+			expected.push_back((--r)->first);
+		expect(got == expected, layout, "reverse_range_scan()", lo);
+	}
+}
+
+/* one random write through each write method, applied to @ref as well */
+template <typename List>
+void write_some(List &list, reference_map &ref, const std::string &layout, std::mt19937_64 &rng, int ops) {
+	std::vector<std::pair<uint64_t, uint64_t>> batch;
+	for (int i = 0; i < ops; i++) {
+		uint64_t key = rng() % kKeys;
+		uint64_t value = rng() % 1000;
+		bool present = ref.count(key) != 0;
+		switch (rng() % 8) {
+		case 0:
+		case 1: {
+			auto res = list.try_emplace(key, value);
+			expect(res.second != present && res.first->first == key, layout, "try_emplace()", key);
+			ref.emplace(key, value);
+			break;
+		}
+		case 2:
+			expect(list.erase(key) == (present ? 1 : 0), layout, "erase()", key);
+			ref.erase(key);
+			break;
+		case 3: {
+			auto res = list.insert_or_assign(key, value);
+			expect(res.second != present, layout, "insert_or_assign()", key);
+			ref[key] = value;
+			break;
+		}
+		case 4:
+			expect(list.assign(key, value) == present, layout, "assign()", key);
+			if (present)
+				ref[key] = value;
+			break;
+		case 5:
+			expect(list.update(key, [](uint64_t v) { return v + 1; }) == present, layout, "update()", key);
+			if (present)
+				ref[key]++;
+			break;
+		case 6: {
+			auto res = list.upsert(key, value, [](uint64_t v, uint64_t operand) { return v + operand; });
+			expect(res.second != present, layout, "upsert()", key);
+			ref[key] = present ? ref[key] + value : value;
+			break;
+		}
+		default: {
+			batch.clear();
+			for (uint64_t k = key; k < std::min(kKeys, key + 1 + rng() % 8); k++)
+				batch.emplace_back(k, value);
+			size_t added = 0;
+			for (auto &e : batch)
+				added += ref.emplace(e.first, e.second).second;
+			expect(list.insert_batch(batch.begin(), batch.end()) == added, layout, "insert_batch()", key);
+		}
+		}
+	}
+}
+
+/* versioned lists do not expire */
+template <typename List>
+void expire(List &list, reference_map &ref, const std::string &layout, std::false_type) {}
+
+template <typename List>
+void expire(List &list, reference_map &ref, const std::string &layout, std::true_type) {
+	uint64_t cutoff = kKeys / 3;
+	size_t expired = std::distance(ref.begin(), ref.lower_bound(cutoff));
+	expect(list.expire_before(cutoff) == expired, layout, "expire_before()", cutoff);
+	ref.erase(ref.begin(), ref.lower_bound(cutoff));
+	check_list(list, ref, layout + " expired");
+}
+
+template <typename Traits>
+void run_list(const std::string &layout) {
+	fixture<list_of<Traits>> fx;
+	auto *list = &fx.get();
+	reference_map ref;
+	std::mt19937_64 rng(1);
+
+	/* bulk_load keeps the sorted prefix of its input, skipping repeats */
+	std::vector<std::pair<uint64_t, uint64_t>> load;
+	for (uint64_t key = 0; key < kKeys; key += 1 + rng() % 3) {
+		load.emplace_back(key, key);
+		if (key % 10 == 0)
+			load.emplace_back(key, key + 1);
+	}
+	for (auto &e : load)
+		ref.emplace(e.first, e.second);
+	load.emplace_back(1, 1);
+	try {
+		list->bulk_load(load.begin(), load.end());
+		fail(layout, "bulk_load() took unsorted input", 0);
+	} catch (std::invalid_argument &) {
+	}
+	check_list(*list, ref, layout + " bulk_load");
+	try {
+		list->bulk_load(load.begin(), load.begin() + 1);
+		fail(layout, "bulk_load() into a filled list", 0);
+	} catch (std::logic_error &) {
+	}
+
+	write_some(*list, ref, layout, rng, 2000);
+	check_list(*list, ref, layout + " writes");
+
+	/* the runtime is rebuilt from pmem: slabs, DRAM indexes, versions */
+	list = &fx.reopen();
+	list->runtime_initialize();
+	check_list(*list, ref, layout + " reopened");
+	write_some(*list, ref, layout, rng, 2000);
+	check_list(*list, ref, layout + " reopened writes");
+
+	list->runtime_finalize();
+	auto stats = list->recover(4);
+	expect(stats.nodes == ref.size(), layout, "recover() nodes", stats.nodes);
+	check_list(*list, ref, layout + " recovered");
+
+	expire(*list, ref, layout, std::integral_constant<bool, !Traits::versioned>());
+	write_some(*list, ref, layout, rng, 500);
+	check_list(*list, ref, layout + " expired writes");
+
+	printf("%-12s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+/* ------------------------------------------------------------- snapshots */
+
+using versioned_list = list_of<versioned_traits>;
+
+/* @snap sees exactly the elements of @ref, with their values then */
+void check_snapshot(versioned_list &list, const versioned_list::snapshot_type &snap, const reference_map &ref,
+		    const std::string &layout) {
+	for (uint64_t key = 0; key <= kKeys; key++) {
+		auto found = list.find(key, snap);
+		auto r = ref.find(key);
+		expect((found == nullptr) == (r == ref.end()), layout, "find(key, snap) presence", key);
+		if (found && r != ref.end())
+			expect(found->first == key && found->second == r->second, layout, "find(key, snap) value", key);
+	}
+	reference_map got;
+	list.scan(uint64_t(0), kKeys, snap, [&](const versioned_list::value_type &e) {
+		expect(got.emplace(e.first, e.second).second, layout, "scan(snap) saw a key twice", e.first);
+		return true;
+	});
+	expect(got == ref, layout, "scan(snap)", got.size());
+}
+
+/* erases, overwrites, updates and inserts a few keys of each kind */
+void write_versions(versioned_list &list, reference_map &ref, uint64_t base) {
+	for (uint64_t key = base; key < base + 5; key++) {
+		list.erase(key);
+		ref.erase(key);
+	}
+	for (uint64_t key = base + 5; key < base + 10; key++) {
+		list.insert_or_assign(key, key + 1000);
+		ref[key] = key + 1000;
+	}
+	list.update(base + 10, [](uint64_t v) { return v + 1; });
+	ref[base + 10]++;
+	list.erase(base + 11);
+	list.try_emplace(base + 11, uint64_t(7));
+	ref[base + 11] = 7;
+	for (uint64_t key = kKeys - base / 10 - 5; key < kKeys - base / 10; key++) {
+		list.try_emplace(key, key);
+		ref.emplace(key, key);
+	}
+}
+
+void run_snapshots() {
+	const std::string layout = "snapshots";
+	fixture<versioned_list> fx;
+	versioned_list *list = &fx.get();
+	reference_map ref;
+	for (uint64_t key = 0; key < 200; key++) {
+		list->try_emplace(key, key);
+		ref.emplace(key, key);
+	}
+
+	{
+		auto first = list->snapshot();
+		reference_map then = ref;
+		write_versions(*list, ref, 10);
+		check_snapshot(*list, first, then, layout + " first");
+		check_list(*list, ref, layout + " current");
+
+		auto second = list->snapshot();
+		reference_map later = ref;
+		write_versions(*list, ref, 50);
+		check_snapshot(*list, first, then, layout + " first");
+		check_snapshot(*list, second, later, layout + " second");
+
+		/* purging what only the first one saw keeps the second intact */
+		{
+			auto gone = std::move(first);
+		}
+		list->reclaim();
+		check_snapshot(*list, second, later, layout + " second alone");
+		check_list(*list, ref, layout + " current");
+	}
+
+	/* recover_versions() drops the hidden versions and resumes the clock,
+	 * so that a snapshot after the restart still orders the writes after
+	 * it */
+	list = &fx.reopen();
+	list->runtime_initialize();
+	check_list(*list, ref, layout + " reopened");
+	{
+		auto snap = list->snapshot();
+		reference_map then = ref;
+		check_snapshot(*list, snap, then, layout + " reopened");
+		write_versions(*list, ref, 100);
+		check_snapshot(*list, snap, then, layout + " reopened");
+		check_list(*list, ref, layout + " reopened current");
+	}
+	printf("%-12s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+/* ---------------------------------------------------- out-of-line values */
+
+struct blob {
+	uint64_t word[4];
+
+	explicit blob(uint64_t v = 0) {
+		for (uint64_t i = 0; i < 4; i++)
+			word[i] = v + i;
+	}
+
+	bool holds(uint64_t v) const {
+		return word[0] == v && word[3] == v + 3;
+	}
+};
+
+using ool_list = persistent_skiplist<uint64_t, blob, std::less<uint64_t>, 8, 2, ool_traits>;
+
+void check_ool(ool_list &list, const reference_map &ref, const std::string &layout) {
+	expect(list.size() == ref.size(), layout, "size()", list.size());
+	for (uint64_t key = 0; key < kKeys; key++) {
+		auto it = list.find(key);
+		auto r = ref.find(key);
+		expect((it == list.end()) == (r == ref.end()), layout, "find() presence", key);
+		if (it != list.end() && r != ref.end())
+			expect(it->second.get().holds(r->second), layout, "out-of-line value", key);
+	}
+}
+
+void run_out_of_line() {
+	const std::string layout = "out-of-line";
+	static_assert(ool_list::atomic_update, "out_of_line values are replaced atomically");
+	fixture<ool_list> fx;
+	ool_list *list = &fx.get();
+	reference_map ref;
+	std::mt19937_64 rng(2);
+	for (int i = 0; i < 3000; i++) {
+		uint64_t key = rng() % kKeys;
+		uint64_t value = rng() % 1000;
+		bool present = ref.count(key) != 0;
+		switch (rng() % 5) {
+		case 0:
+			list->try_emplace(key, blob(value));
+			ref.emplace(key, value);
+			break;
+		case 1:
+			expect(list->erase(key) == (present ? 1 : 0), layout, "erase()", key);
+			ref.erase(key);
+			break;
+		case 2:
+			expect(list->insert_or_assign(key, blob(value)).second != present, layout, "insert_or_assign()", key);
+			ref[key] = value;
+			break;
+		case 3:
+			expect(list->assign(key, blob(value)) == present, layout, "assign()", key);
+			if (present)
+				ref[key] = value;
+			break;
+		default:
+			expect(list->update(key, [](const blob &b) { return blob(b.word[0] + 1); }) == present, layout,
+			       "update()", key);
+			if (present)
+				ref[key]++;
+		}
+	}
+	list->reclaim();
+	check_ool(*list, ref, layout);
+	list = &fx.reopen();
+	list->runtime_initialize();
+	check_ool(*list, ref, layout + " reopened");
+	printf("%-12s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+/* -------------------------------------------------------- two-level list */
+
+using two_level = persistent_two_level_skiplist<uint64_t, uint64_t, uint64_t>;
+/* (primary key, timestamp) -> value */
+using record_map = std::map<std::pair<uint64_t, uint64_t>, uint64_t>;
+
+void check_two_level(two_level &list, const record_map &ref, const std::string &layout) {
+	expect(list.size() == ref.size(), layout, "size()", list.size());
+	/* primary keys ascending, each newest first */
+	auto it = list.begin();
+	for (uint64_t pkey = 0; pkey < 10; pkey++) {
+		std::vector<std::pair<uint64_t, uint64_t>> records;
+		for (auto r = ref.lower_bound({pkey, 0}); r != ref.end() && r->first.first == pkey; ++r)
+			records.emplace_back(r->first.second, r->second);
+		std::reverse(records.begin(), records.end());
+		for (auto &rec : records) {
+			if (it == list.end() || it->first.pkey != pkey || it->first.ts != rec.first) {
+				fail(layout, "iteration order", pkey);
+				return;
+			}
+			++it;
+		}
+
+		std::vector<std::pair<uint64_t, uint64_t>> got;
+		list.latest(pkey, 3, [&](uint64_t ts, uint64_t v) {
+			got.emplace_back(ts, v);
+			return true;
+		});
+		std::vector<std::pair<uint64_t, uint64_t>> want(records.begin(),
+			records.begin() + std::min<size_t>(3, records.size()));
+		expect(got == want, layout, "latest(k)", pkey);
+
+		got.clear();
+		list.time_range(pkey, 5, 12, [&](uint64_t ts, uint64_t v) {
+			got.emplace_back(ts, v);
+			return true;
+		});
+		want.clear();
+		for (auto &rec : records) {
+			if (rec.first >= 5 && rec.first <= 12)
+				want.push_back(rec);
+		}
+		expect(got == want, layout, "time_range()", pkey);
+
+		auto newest = list.latest(pkey);
+		expect(records.empty() ? newest == list.end() : (newest != list.end() && newest->first.ts == records[0].first),
+		       layout, "latest()", pkey);
+		for (uint64_t ts = 0; ts < 20; ts++) {
+			auto found = list.find(pkey, ts);
+			auto r = ref.find({pkey, ts});
+			expect((found == list.end()) == (r == ref.end()), layout, "find()", pkey);
+		}
+	}
+	expect(it == list.end(), layout, "iteration length", 0);
+}
+
+void run_two_level() {
+	const std::string layout = "two-level";
+	fixture<two_level> fx;
+	two_level *list = &fx.get();
+	record_map ref;
+	std::mt19937_64 rng(3);
+	for (int i = 0; i < 400; i++) {
+		uint64_t pkey = rng() % 10, ts = rng() % 20, value = rng();
+		bool present = ref.count({pkey, ts}) != 0;
+		if (rng() % 4) {
+			expect(list->insert(pkey, ts, value).second != present, layout, "insert()", pkey);
+			ref.emplace(std::make_pair(pkey, ts), value);
+		} else {
+			expect(list->erase(pkey, ts) == (present ? 1 : 0), layout, "erase(pkey, ts)", pkey);
+			ref.erase({pkey, ts});
+		}
+	}
+	check_two_level(*list, ref, layout);
+
+	size_t records = 0;
+	for (auto r = ref.lower_bound({4, 0}); r != ref.end() && r->first.first == 4;)
+		r = ref.erase(r), records++;
+	expect(list->erase(uint64_t(4)) == records, layout, "erase(pkey)", 4);
+	check_two_level(*list, ref, layout + " erase(pkey)");
+
+	list = &fx.reopen();
+	list->runtime_initialize();
+	check_two_level(*list, ref, layout + " reopened");
+	printf("%-12s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+/* --------------------------------------------------------- sharded lists */
+
+template <typename List>
+struct shard_set {
+	List shards[3];
+
+	std::vector<List *> pointers() {
+		return {&shards[0], &shards[1], &shards[2]};
+	}
+
+	void runtime_finalize() {
+		for (auto &s : shards)
+			s.runtime_finalize();
+	}
+};
+
+template <typename Sharded>
+void check_sharded(Sharded &list, const reference_map &ref, const std::string &layout) {
+	expect(list.size() == ref.size(), layout, "size()", list.size());
+	auto want = ref.begin();
+	for (auto it = list.begin(); it != list.end(); ++it, ++want) {
+		if (want == ref.end() || it->first != want->first || it->second != want->second) {
+			fail(layout, "merged iteration", it->first);
+			break;
+		}
+	}
+	for (uint64_t key = 0; key <= kKeys; key++) {
+		size_t shard = list.shard_of(key);
+		auto it = list.find(key);
+		auto r = ref.find(key);
+		expect((it == list.end(shard)) == (r == ref.end()), layout, "find()", key);
+		if (r != ref.end())
+			expect(list.shard(shard).find(key) != list.shard(shard).end(), layout, "key outside its shard", key);
+		auto lb = list.lower_bound(key);
+		auto rlb = ref.lower_bound(key);
+		expect((lb == list.end()) == (rlb == ref.end()) && (lb == list.end() || lb->first == rlb->first),
+		       layout, "lower_bound()", key);
+	}
+	std::vector<uint64_t> got, expected;
+	list.scan(uint64_t(50), uint64_t(150), [&](const typename Sharded::value_type &e) {
+		got.push_back(e.first);
+		return true;
+	});
+	for (auto r = ref.lower_bound(50); r != ref.upper_bound(150); ++r)
+		expected.push_back(r->first);
+	expect(got == expected, layout, "scan()", 50);
+}
+
+template <typename Sharded, typename Partition>
+void run_sharded(const std::string &layout, Partition partition) {
+	fixture<shard_set<typename Sharded::list_type>> fx;
+	Sharded list(fx.get().pointers(), partition);
+	reference_map ref;
+	std::mt19937_64 rng(4);
+	for (int i = 0; i < 2000; i++) {
+		uint64_t key = rng() % kKeys, value = rng() % 1000;
+		bool present = ref.count(key) != 0;
+		switch (rng() % 4) {
+		case 0:
+			expect(list.try_emplace(key, value).second != present, layout, "try_emplace()", key);
+			ref.emplace(key, value);
+			break;
+		case 1:
+			expect(list.erase(key) == (present ? 1 : 0), layout, "erase()", key);
+			ref.erase(key);
+			break;
+		case 2:
+			expect(list.insert_or_assign(key, value).second != present, layout, "insert_or_assign()", key);
+			ref[key] = value;
+			break;
+		default:
+			expect(list.update(key, [](uint64_t v) { return v * 2; }) == present, layout, "update()", key);
+			if (present)
+				ref[key] *= 2;
+		}
+	}
+	check_sharded(list, ref, layout);
+
+	list.runtime_finalize();
+	list.recover(2);
+	check_sharded(list, ref, layout + " recovered");
+	printf("%-12s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[]) {
+	if (argc > 1)
+		pool_path = argv[1];
+
+	run_list<default_skiplist_traits>("default");
+	run_list<inline_traits>("inline");
+	run_list<prefix_traits>("prefix");
+	run_list<hybrid_traits>("hybrid");
+	run_list<slab_traits>("slab");
+	run_list<hash_traits>("hash");
+	run_list<indexable_traits>("indexable");
+	run_list<versioned_traits>("versioned");
+	run_snapshots();
+	run_out_of_line();
+	run_two_level();
+	/* the default partition, whatever the key type */
+	run_sharded<sharded_skiplist<uint64_t, uint64_t>>("sharded", hash_partition<>());
+	run_sharded<sharded_skiplist<uint64_t, uint64_t, range_partition<uint64_t>>>(
+		"ranged", range_partition<uint64_t>({100, 200}));
+	return failures ? 1 : 0;
+}
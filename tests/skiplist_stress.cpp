@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+/*
+ * skiplist_stress: threads insert, batch insert, erase and find a small
+ * range of keys concurrently, so that towers are still being linked while
+ * their nodes are erased, then the list is checked against what the
+ * threads were told. A short, wide list (Branch 2) gives most nodes upper
+ * levels. Exits non-zero if anything does not match.
+ *
+ *   skiplist_stress [pool path] [threads] [ops per thread]
+ */
+
+#include <libpmemobj++/make_persistent.hpp>
+#include <libpmemobj++/persistent_ptr.hpp>
+#include <libpmemobj++/pool.hpp>
+#include <libpmemobj++/transaction.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "persistent_skiplist.h"
+
+using namespace pmem::kv;
+using pmem::obj::make_persistent;
+using pmem::obj::persistent_ptr;
+using pmem::obj::pool;
+using pmem::obj::transaction;
+
+namespace
+{
+
+constexpr uint64_t kKeys = 512;
+
+struct options {
+	std::string pool = "/dev/shm/skiplist_stress";
+	unsigned threads = 4;
+	uint64_t ops = 50000;
+};
+
+uint64_t value_of(uint64_t key) {
+	return key * 0x9e3779b97f4a7c15ULL;
+}
+
+struct key_mix {
+	uint64_t operator()(uint64_t key) const {
+		return value_of(key) ^ (key >> 7);
+	}
+};
+
+struct inline_traits : default_skiplist_traits {
+	static constexpr bool inline_tower = true;
+};
+struct hybrid_traits : inline_traits {
+	static constexpr bool hybrid_index = true;
+};
+struct hash_traits : default_skiplist_traits {
+	using key_hash = key_mix;
+};
+struct indexable_traits : default_skiplist_traits {
+	static constexpr bool indexable = true;
+};
+struct versioned_traits : default_skiplist_traits {
+	static constexpr bool versioned = true;
+};
+
+template <typename T>
+struct stress_root {
+	persistent_ptr<T> object;
+};
+
+int failures = 0;
+
+void fail(const std::string &layout, const std::string &what, uint64_t key) {
+	fprintf(stderr, "%s: %s (key %llu)\n", layout.c_str(), what.c_str(), (unsigned long long)key);
+	failures++;
+}
+
+/* successful inserts minus successful erases of each key: 1 if it must be
+ * in the list at the end, 0 otherwise */
+struct reference {
+	std::vector<std::atomic<int64_t>> balance;
+	std::atomic<int64_t> batched{0};
+
+	reference() : balance(kKeys) {
+		for (auto &b : balance)
+			b.store(0);
+	}
+};
+
+template <typename List>
+void worker(List &list, const std::string &layout, reference &ref, unsigned seed, uint64_t ops, uint64_t keys,
+	    bool batches) {
+	std::mt19937_64 rng(seed);
+	std::vector<std::pair<uint64_t, uint64_t>> batch;
+	for (uint64_t i = 0; i < ops; i++) {
+		uint64_t key = rng() % keys;
+		unsigned op = rng() % 8;
+		if (op == 6 && !batches)
+			op = 7;
+		switch (op) {
+		case 0:
+		case 1:
+		case 2:
+			if (list.try_emplace(key, value_of(key)).second)
+				ref.balance[key]++;
+			break;
+		case 3:
+		case 4:
+		case 5:
+			if (list.erase(key))
+				ref.balance[key]--;
+			break;
+		case 6: {
+			/* a run of neighbours, linked as chains sharing their gaps */
+			batch.clear();
+			for (uint64_t k = key; k < std::min(keys, key + 1 + rng() % 16); k++)
+				batch.emplace_back(k, value_of(k));
+			/* which keys made it is unknown, only how many */
+			ref.batched += list.insert_batch(batch.begin(), batch.end());
+			break;
+		}
+		default: {
+			auto it = list.find(key);
+			if (it != list.end() && (it->first != key || it->second != value_of(key)))
+				fail(layout, "find returned the wrong element", key);
+		}
+		}
+	}
+}
+
+/* the list on its own agrees with size(), and with the threads' accounts */
+template <typename List>
+void check(List &list, const std::string &layout, reference &ref) {
+	int64_t expected = ref.batched;
+	for (uint64_t key = 0; key < kKeys; key++)
+		expected += ref.balance[key];
+	if (int64_t(list.size()) != expected)
+		fail(layout, "size() " + std::to_string(list.size()) + " != " + std::to_string(expected), 0);
+
+	size_t walked = 0;
+	bool first = true;
+	uint64_t prev = 0;
+	for (auto it = list.begin(); it != list.end(); ++it, walked++) {
+		if (!first && it->first <= prev)
+			fail(layout, "keys out of order", it->first);
+		if (it->second != value_of(it->first))
+			fail(layout, "wrong value", it->first);
+		first = false;
+		prev = it->first;
+	}
+	if (walked != list.size())
+		fail(layout, "iteration saw " + std::to_string(walked) + " elements", 0);
+
+	/* every search starts on the upper levels */
+	size_t found = 0;
+	for (uint64_t key = 0; key < kKeys; key++) {
+		auto it = list.find(key);
+		if (it == list.end()) {
+			auto lb = list.lower_bound(key);
+			if (lb != list.end() && lb->first == key)
+				fail(layout, "lower_bound found a key find missed", key);
+			continue;
+		}
+		found++;
+		if (it->first != key)
+			fail(layout, "find returned another key", key);
+	}
+	if (found != walked)
+		fail(layout, "find saw " + std::to_string(found) + " elements", 0);
+}
+
+/* single inserts and erases only: each key's account is exact */
+template <typename List>
+void check_exact(List &list, const std::string &layout, reference &ref) {
+	for (uint64_t key = 0; key < kKeys; key++) {
+		int64_t balance = ref.balance[key];
+		bool present = list.find(key) != list.end();
+		if (balance != 0 && balance != 1)
+			fail(layout, "inserted/erased " + std::to_string(balance) + " times net", key);
+		else if (present != (balance == 1))
+			fail(layout, present ? "present after its erase" : "missing after its insert", key);
+	}
+}
+
+/* @keys below kKeys narrows the range, so that the same few towers are
+ * linked and erased over and over by different threads */
+template <typename Traits>
+void run(const options &opt, const std::string &layout, uint64_t keys = kKeys) {
+	using list_type = persistent_skiplist<uint64_t, uint64_t, std::less<uint64_t>, 8, 2, Traits>;
+	::unlink(opt.pool.c_str());
+	auto pop = pool<stress_root<list_type>>::create(opt.pool, "skiplist_stress", 256 << 20, S_IWUSR | S_IRUSR);
+	auto root = pop.root();
+	transaction::run(pop, [&] { root->object = make_persistent<list_type>(); });
+	list_type &list = *root->object;
+
+	/* round 0 without batches, so that every key can be checked */
+	for (int round = 0; round < 2; round++) {
+		reference ref;
+		for (uint64_t key = 0; key < kKeys; key++)
+			ref.balance[key] = list.find(key) != list.end();
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < opt.threads; t++)
+			threads.emplace_back([&, t] { worker(list, layout, ref, t + 1, opt.ops, keys, round > 0); });
+		for (auto &t : threads)
+			t.join();
+		check(list, layout, ref);
+		if (round == 0)
+			check_exact(list, layout, ref);
+	}
+
+	/* the retired nodes are freed here; a tower still leading to one of
+	 * them would be found by the searches after a restart */
+	list.runtime_finalize();
+	list.runtime_initialize();
+	reference ref;
+	for (uint64_t key = 0; key < kKeys; key++)
+		ref.balance[key] = list.find(key) != list.end();
+	check(list, layout, ref);
+
+	list.runtime_finalize();
+	pop.close();
+	::unlink(opt.pool.c_str());
+	printf("%-10s %s\n", layout.c_str(), failures ? "FAILED" : "ok");
+}
+
+} /* namespace */
+
+int main(int argc, char *argv[]) {
+	options opt;
+	if (argc > 1)
+		opt.pool = argv[1];
+	if (argc > 2)
+		opt.threads = std::max(1, atoi(argv[2]));
+	if (argc > 3)
+		opt.ops = std::strtoull(argv[3], nullptr, 10);
+
+	run<default_skiplist_traits>(opt, "default");
+	run<inline_traits>(opt, "inline");
+	run<hybrid_traits>(opt, "hybrid");
+	/* a DRAM index entry erased while its upper levels are being linked */
+	run<hybrid_traits>(opt, "hybrid-hot", 8);
+	run<hash_traits>(opt, "hash");
+	run<indexable_traits>(opt, "indexable");
+	run<versioned_traits>(opt, "versioned");
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,181 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef VOLATILE_HASH
+#define VOLATILE_HASH
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/*
+ * DRAM hash of the live nodes of a list, so that exact-key lookups skip
+ * the ordered search. Chained buckets: readers are lock-free, writers are
+ * serialized per stripe of buckets and growing the table takes every
+ * stripe. Growing copies the entries into a new table, so readers can
+ * finish their walk through the old one.
+ *
+ * Unlinked entries and replaced tables are handed to the caller, which
+ * must defer destroy() until no reader can hold them.
+ */
+template <typename Node>
+class volatile_hash {
+public:
+	struct entry {
+		uint64_t hash;
+		Node *node;
+		std::atomic<entry *> next;
+	};
+
+	volatile_hash() : _table(create_table(kMinBuckets)), _count(0) {}
+
+	~volatile_hash() {
+		free_table(_table.load(std::memory_order_relaxed));
+	}
+
+	volatile_hash(const volatile_hash &) = delete;
+	volatile_hash &operator=(const volatile_hash &) = delete;
+
+	static void destroy(void *block) {
+		::operator delete(block);
+	}
+
+	/* first node of @hash for which @match(node) holds, nullptr if none */
+	template <typename Match>
+	Node *find(uint64_t hash, Match &&match) const {
+		table *t = _table.load(std::memory_order_acquire);
+		for (entry *e = t->bucket(hash).load(std::memory_order_acquire); e;
+		     e = e->next.load(std::memory_order_acquire)) {
+			if (e->hash == hash && match(e->node))
+				return e->node;
+		}
+		return nullptr;
+	}
+
+	/* @retired receives the blocks to destroy() if the table grew */
+	void insert(uint64_t hash, Node *node, std::vector<void *> &retired) {
+		size_t buckets;
+		{
+			std::lock_guard<std::mutex> g(_stripes[hash % kStripes]);
+			table *t = _table.load(std::memory_order_relaxed);
+			push(t, hash, node);
+			buckets = t->mask + 1;
+		}
+		if (_count.fetch_add(1, std::memory_order_relaxed) + 1 > kLoad * buckets)
+			grow(retired);
+	}
+
+	/* Unlinks the entry of @node; returns it for deferred destruction, or
+	 * nullptr if @node is not in the hash. */
+	entry *remove(uint64_t hash, Node *node) {
+		std::lock_guard<std::mutex> g(_stripes[hash % kStripes]);
+		std::atomic<entry *> *link = &_table.load(std::memory_order_relaxed)->bucket(hash);
+		for (entry *e = link->load(std::memory_order_relaxed); e; e = e->next.load(std::memory_order_relaxed)) {
+			if (e->node == node) {
+				link->store(e->next.load(std::memory_order_relaxed), std::memory_order_release);
+				_count.fetch_sub(1, std::memory_order_relaxed);
+				return e;
+			}
+			link = &e->next;
+		}
+		return nullptr;
+	}
+
+	/* Single-shot construction from (hash, node) pairs; the hash must be
+	 * empty and not in use. */
+	void build(const std::vector<std::pair<uint64_t, Node *>> &entries) {
+		size_t buckets = kMinBuckets;
+		while (kLoad * buckets < entries.size())
+			buckets *= 2;
+		table *t = create_table(buckets);
+		for (auto &e : entries)
+			push(t, e.first, e.second);
+		free_table(_table.exchange(t, std::memory_order_release));
+		_count.store(entries.size(), std::memory_order_relaxed);
+	}
+
+private:
+	static constexpr size_t kMinBuckets = 1024;
+	static constexpr size_t kStripes = 64;
+	/* entries per bucket before the table doubles */
+	static constexpr size_t kLoad = 2;
+
+	struct table {
+		size_t mask;
+
+		std::atomic<entry *> &bucket(uint64_t hash) {
+			return reinterpret_cast<std::atomic<entry *> *>(this + 1)[hash & mask];
+		}
+	};
+
+	std::atomic<table *> _table;
+	std::atomic<size_t> _count;
+	std::array<std::mutex, kStripes> _stripes;
+
+	static table *create_table(size_t buckets) {
+		void *mem = ::operator new(sizeof(table) + sizeof(std::atomic<entry *>) * buckets);
+		table *t = new (mem) table();
+		t->mask = buckets - 1;
+		for (size_t i = 0; i < buckets; i++)
+			new (&t->bucket(i)) std::atomic<entry *>(nullptr);
+		return t;
+	}
+
+	static void free_table(table *t) {
+		for (size_t i = 0; i <= t->mask; i++) {
+			entry *e = t->bucket(i).load(std::memory_order_relaxed);
+			while (e) {
+				entry *next = e->next.load(std::memory_order_relaxed);
+				destroy(e);
+				e = next;
+			}
+		}
+		destroy(t);
+	}
+
+	/* the caller owns the bucket */
+	static void push(table *t, uint64_t hash, Node *node) {
+		std::atomic<entry *> &bucket = t->bucket(hash);
+		entry *e = new (::operator new(sizeof(entry))) entry();
+		e->hash = hash;
+		e->node = node;
+		e->next.store(bucket.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		bucket.store(e, std::memory_order_release);
+	}
+
+	void grow(std::vector<void *> &retired) {
+		std::array<std::unique_lock<std::mutex>, kStripes> locks;
+		for (size_t i = 0; i < kStripes; i++)
+			locks[i] = std::unique_lock<std::mutex>(_stripes[i]);
+		table *old = _table.load(std::memory_order_relaxed);
+		if (_count.load(std::memory_order_relaxed) <= kLoad * (old->mask + 1))
+			return;
+		table *t = create_table(2 * (old->mask + 1));
+		for (size_t i = 0; i <= old->mask; i++) {
+			for (entry *e = old->bucket(i).load(std::memory_order_relaxed); e;
+			     e = e->next.load(std::memory_order_relaxed)) {
+				push(t, e->hash, e->node);
+				retired.push_back(e);
+			}
+		}
+		retired.push_back(old);
+		_table.store(t, std::memory_order_release);
+	}
+};
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // VOLATILE_HASH
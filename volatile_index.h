@@ -0,0 +1,271 @@
+// SPDX-License-Identifier: BSD-3-Clause
+/* Copyright 2021, 4Paradigm Inc. */
+
+#ifndef VOLATILE_INDEX
+#define VOLATILE_INDEX
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace pmem
+{
+namespace kv
+{
+namespace internal
+{
+
+/*
+ * DRAM-resident upper levels of a hybrid skiplist. Every entry points to a
+ * persistent level-0 node and caches its key prefix, so descending the index
+ * only touches pmem when prefixes tie. Entries are ordered by key and then by
+ * node address, which keeps them unique while a key is being re-inserted.
+ *
+ * Lock-free: links carry a mark in bit 0 for logical deletion. Removed
+ * entries are returned to the caller, which must defer destroy() until no
+ * thread can still hold them.
+ */
+template <typename Node, uint8_t Levels>
+class volatile_index {
+public:
+	struct vnode {
+		Node *node;
+		uint64_t prefix;
+		uint8_t levels;
+
+		std::atomic<uintptr_t> *links() {
+			return reinterpret_cast<std::atomic<uintptr_t> *>(this + 1);
+		}
+	};
+
+	struct entry {
+		Node *node;
+		uint64_t prefix;
+		uint8_t levels;
+	};
+
+	volatile_index() {
+		_head = create(nullptr, 0, Levels);
+	}
+
+	~volatile_index() {
+		vnode *v = _head;
+		while (v) {
+			vnode *next = ptr(v->links()[0].load(std::memory_order_relaxed));
+			destroy(v);
+			v = next;
+		}
+	}
+
+	volatile_index(const volatile_index &) = delete;
+	volatile_index &operator=(const volatile_index &) = delete;
+
+	static vnode *create(Node *node, uint64_t prefix, uint8_t levels) {
+		void *mem = ::operator new(sizeof(vnode) + sizeof(std::atomic<uintptr_t>) * levels);
+		vnode *v = new (mem) vnode();
+		v->node = node;
+		v->prefix = prefix;
+		v->levels = levels;
+		for (uint8_t i = 0; i < levels; i++)
+			new (&v->links()[i]) std::atomic<uintptr_t>(0);
+		return v;
+	}
+
+	static void destroy(vnode *v) {
+		::operator delete(v);
+	}
+
+	/* Last node whose key is below the search key, nullptr if there is none.
+	 * @cmp(node, prefix) orders an entry against the search key (<0, 0, >0). */
+	template <typename Cmp>
+	Node *floor(Cmp &&cmp) {
+		vnode *x = _head;
+		for (int lv = Levels - 1; lv >= 0; lv--) {
+			vnode *n = ptr(x->links()[lv].load(std::memory_order_acquire));
+			while (n) {
+				uintptr_t after = n->links()[lv].load(std::memory_order_acquire);
+				if (is_marked(after)) {
+					n = ptr(after);
+					continue;
+				}
+				if (cmp(n->node, n->prefix) >= 0)
+					break;
+				x = n;
+				n = ptr(after);
+			}
+		}
+		return x->node;
+	}
+
+	template <typename Cmp>
+	void insert(Node *node, uint64_t prefix, uint8_t levels, Cmp &&cmp) {
+		assert(levels > 0 && levels <= Levels);
+		vnode *v = create(node, prefix, levels);
+		std::array<vnode *, Levels> pre, succ;
+		while (true) {
+			find(node, cmp, pre, succ);
+			for (uint8_t i = 0; i < levels; i++)
+				v->links()[i].store((uintptr_t)succ[i], std::memory_order_relaxed);
+			uintptr_t expected = (uintptr_t)succ[0];
+			if (pre[0]->links()[0].compare_exchange_strong(expected, (uintptr_t)v))
+				break;
+		}
+		for (uint8_t i = 1; i < levels; i++) {
+			while (true) {
+				uintptr_t cur = v->links()[i].load();
+				if (is_marked(cur))
+					return;
+				if (ptr(cur) != succ[i] &&
+				    !v->links()[i].compare_exchange_strong(cur, (uintptr_t)succ[i]))
+					continue;
+				uintptr_t expected = (uintptr_t)succ[i];
+				if (pre[i]->links()[i].compare_exchange_strong(expected, (uintptr_t)v)) {
+					/* a remove() that marked v before this link may have
+					 * already returned it; unlink it again */
+					if (is_marked(v->links()[i].load())) {
+						find(node, cmp, pre, succ);
+						return;
+					}
+					break;
+				}
+				find(node, cmp, pre, succ);
+			}
+		}
+	}
+
+	/* Unlinks the entry of @node. Returns it for deferred destruction, or
+	 * nullptr if it is not indexed or another thread is removing it. */
+	template <typename Cmp>
+	vnode *remove(Node *node, Cmp &&cmp) {
+		std::array<vnode *, Levels> pre, succ;
+		vnode *v = find(node, cmp, pre, succ);
+		if (!v)
+			return nullptr;
+		for (int i = v->levels - 1; i >= 1; i--)
+			mark(v, i);
+		if (!mark(v, 0))
+			return nullptr;
+		find(node, cmp, pre, succ);
+		return v;
+	}
+
+	/* Single-shot construction from entries in key order; the index must be
+	 * empty and not in use. Towers are linked in parallel per chunk and the
+	 * chunks are then stitched together level by level. */
+	void build(const std::vector<entry> &entries, unsigned threads) {
+		using level_array = std::array<vnode *, Levels>;
+		threads = std::max(1u, std::min<unsigned>(threads, entries.size() / 4096 + 1));
+		size_t chunk = (entries.size() + threads - 1) / threads;
+		std::vector<level_array> first(threads), last(threads);
+		auto link_chunk = [&](unsigned c) {
+			first[c].fill(nullptr);
+			last[c].fill(nullptr);
+			size_t end = std::min(entries.size(), (c + 1) * chunk);
+			for (size_t i = c * chunk; i < end; i++) {
+				const entry &e = entries[i];
+				vnode *v = create(e.node, e.prefix, e.levels);
+				for (uint8_t lv = 0; lv < e.levels; lv++) {
+					if (last[c][lv])
+						last[c][lv]->links()[lv].store((uintptr_t)v, std::memory_order_relaxed);
+					else
+						first[c][lv] = v;
+					last[c][lv] = v;
+				}
+			}
+		};
+		std::vector<std::thread> workers;
+		for (unsigned c = 1; c < threads; c++)
+			workers.emplace_back(link_chunk, c);
+		link_chunk(0);
+		for (auto &w : workers)
+			w.join();
+
+		level_array tail;
+		tail.fill(_head);
+		for (unsigned c = 0; c < threads; c++) {
+			for (uint8_t lv = 0; lv < Levels; lv++) {
+				if (!first[c][lv])
+					continue;
+				tail[lv]->links()[lv].store((uintptr_t)first[c][lv], std::memory_order_relaxed);
+				tail[lv] = last[c][lv];
+			}
+		}
+		for (uint8_t lv = 0; lv < Levels; lv++)
+			tail[lv]->links()[lv].store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+	}
+
+private:
+	vnode *_head;
+
+	static bool is_marked(uintptr_t link) {
+		return link & 1;
+	}
+
+	static vnode *ptr(uintptr_t link) {
+		return reinterpret_cast<vnode *>(link & ~uintptr_t(1));
+	}
+
+	/* entry order: key first, node address breaks ties */
+	template <typename Cmp>
+	static int compare(vnode *v, Node *node, Cmp &cmp) {
+		int c = cmp(v->node, v->prefix);
+		if (c != 0)
+			return c;
+		return v->node < node ? -1 : (v->node == node ? 0 : 1);
+	}
+
+	/* predecessors/successors of (@node's key, @node); unlinks marked entries
+	 * on the way and returns the entry of @node if present */
+	template <typename Cmp>
+	vnode *find(Node *node, Cmp &cmp, std::array<vnode *, Levels> &pre,
+		    std::array<vnode *, Levels> &succ) {
+		bool restart = true;
+		while (restart) {
+			restart = false;
+			vnode *x = _head;
+			for (int lv = Levels - 1; lv >= 0 && !restart; lv--) {
+				vnode *n = ptr(x->links()[lv].load(std::memory_order_acquire));
+				while (n) {
+					uintptr_t after = n->links()[lv].load(std::memory_order_acquire);
+					if (is_marked(after)) {
+						uintptr_t expected = (uintptr_t)n;
+						if (!x->links()[lv].compare_exchange_strong(expected, after & ~uintptr_t(1))) {
+							restart = true;
+							break;
+						}
+						n = ptr(after);
+						continue;
+					}
+					if (compare(n, node, cmp) >= 0)
+						break;
+					x = n;
+					n = ptr(after);
+				}
+				pre[lv] = x;
+				succ[lv] = n;
+			}
+		}
+		return (succ[0] && succ[0]->node == node) ? succ[0] : nullptr;
+	}
+
+	static bool mark(vnode *v, uint8_t lv) {
+		uintptr_t cur = v->links()[lv].load();
+		while (!is_marked(cur)) {
+			if (v->links()[lv].compare_exchange_weak(cur, cur | 1))
+				return true;
+		}
+		return false;
+	}
+};
+
+} /* namespace internal */
+} /* namespace kv */
+} /* namespace pmem */
+
+#endif // VOLATILE_INDEX